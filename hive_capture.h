@@ -0,0 +1,113 @@
+/**
+ * \file hive_capture.h
+ * \brief SmartHive datagram capture file format
+ * \author yusuke <gachapin.2nd@gmail.com>
+ *
+ * Written by `smart_hive_udp_server -w FILE`, read by batch import
+ * (`-i FILE`) and test/replay.
+ *
+ *  File:
+ *      +--------------+----------+------+----------+------+----
+ *      | file header  | record 0 | data | record 1 | data | ...
+ *      +--------------+----------+------+----------+------+----
+ *
+ *  All fields are host byte order except the ports and addr, which are
+ *  kept as they appear in sockaddr.  A record with len 0 (zero filled tail
+ *  of an unfinished file) marks the end.
+ *
+ *  Version 2 added listener and local_port (receiving socket); they are
+ *  the reserved bytes of version 1, so version 1 files read as listener 0
+ *  with local_port 0 (unknown).
+ */
+#if !defined(HIVE_CAPTURE_H_INCLUDED)
+#define HIVE_CAPTURE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+
+
+#define HIVE_CAPTURE_MAGIC    (0x50434853U)     /**< "SHCP" */
+#define HIVE_CAPTURE_VERSION  (2)
+
+struct hive_capture_header {
+    uint32_t magic;         /**< HIVE_CAPTURE_MAGIC */
+    uint16_t version;       /**< HIVE_CAPTURE_VERSION */
+    uint16_t header_size;   /**< sizeof(struct hive_capture_header) */
+    uint16_t record_size;   /**< sizeof(struct hive_capture_record) */
+    uint16_t reserved[3];
+};
+_Static_assert(sizeof(struct hive_capture_header) == 16, "capture header layout");
+
+struct hive_capture_record {
+    uint64_t ts_ns;         /**< arrival time (CLOCK_REALTIME, ns) */
+    uint16_t len;           /**< size of data following this record */
+    uint8_t family;         /**< 4: IPv4, 6: IPv6 */
+    uint8_t listener;       /**< receiving listener, index of -l (v2) */
+    uint16_t port;          /**< source port (network byte order) */
+    uint16_t local_port;    /**< receiving port (network byte order, v2) */
+    uint8_t addr[16];       /**< source address (network byte order) */
+};
+_Static_assert(sizeof(struct hive_capture_record) == 32, "capture record layout");
+
+
+
+/** Check file header; returns offset of the first record, 0 if not a capture */
+static inline size_t hive_capture_check(const uint8_t *p_data_, size_t size_)
+{
+    struct hive_capture_header hdr;
+
+    if (size_ < sizeof(hdr)) {
+        return 0;
+    }
+    memcpy(&hdr, p_data_, sizeof(hdr));
+    if (HIVE_CAPTURE_MAGIC != hdr.magic ||
+            hdr.version < 1 || HIVE_CAPTURE_VERSION < hdr.version ||
+            sizeof(struct hive_capture_header) != hdr.header_size ||
+            sizeof(struct hive_capture_record) != hdr.record_size) {
+        return 0;
+    }
+
+    return sizeof(hdr);
+}
+
+
+
+/**
+ * Fetch record at *p_off_ and advance it
+ *
+ * \retval 1 record copied to *p_rec_, data at *pp_data_
+ * \retval 0 end of capture
+ * \retval -1 truncated record
+ */
+static inline int hive_capture_next(const uint8_t *p_data_, size_t size_,
+        size_t *p_off_, struct hive_capture_record *p_rec_,
+        const uint8_t **pp_data_)
+{
+    size_t off = *p_off_;
+
+    if (size_ - off < sizeof(*p_rec_)) {
+        return (size_ == off) ? 0 : -1;
+    }
+    memcpy(p_rec_, &p_data_[off], sizeof(*p_rec_));
+    if (!p_rec_->len) {
+        return 0;
+    }
+    off += sizeof(*p_rec_);
+    if (size_ - off < p_rec_->len) {
+        return -1;
+    }
+    *pp_data_ = &p_data_[off];
+    *p_off_   = off + p_rec_->len;
+
+    return 1;
+}
+
+
+
+#endif /* !defined(HIVE_CAPTURE_H_INCLUDED) */
+
+
+
+/* vim: set ts=4 sts=4 sw=4 expandtab autoindent : */
@@ -0,0 +1,240 @@
+/**
+ * \file hive_store.h
+ * \brief SmartHive columnar segment store format
+ * \author yusuke <gachapin.2nd@gmail.com>
+ *
+ * Written by the column store sink of smart_hive_udp_server, read by
+ * test/store_scan.
+ *
+ *  Segment file (one per HIVE_STORE_SEGMENT_SEC or HIVE_STORE_SEGMENT_ROWS):
+ *
+ *      +--------+------------------+------------------+-----
+ *      | header | column 0         | column 1         | ...
+ *      | (4KiB) | (capacity x w0)  | (capacity x w1)  |
+ *      +--------+------------------+------------------+-----
+ *
+ *  Every column is a plain array of fixed-width little endian integers,
+ *  page aligned, so a scan maps the file and only touches the columns it
+ *  needs.  The header keeps min/max of every column and bitmaps of the
+ *  gateway and device IDs present, so whole segments can be skipped.
+ *  Rows below `nrows' are complete; the writer publishes nrows last, so a
+ *  live segment can be scanned too.
+ */
+#if !defined(HIVE_STORE_H_INCLUDED)
+#define HIVE_STORE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+#define HIVE_STORE_DIR            ("hive_store")
+#define HIVE_STORE_MAGIC          (0x54534853U)     /**< "SHST" */
+#define HIVE_STORE_VERSION        (1)
+#define HIVE_STORE_HEADER_SIZE    (4096)
+#define HIVE_STORE_SEGMENT_ROWS   (1 << 20)         /**< roll by size */
+#define HIVE_STORE_SEGMENT_SEC    (24 * 60 * 60)    /**< roll by time */
+#define HIVE_STORE_SUFFIX         (".seg")
+
+enum tag_HIVE_STORE_COLS {
+    HIVE_STORE_COL_TIME = 0,    /**< arrival time (unix ms), 8 bytes */
+    HIVE_STORE_COL_GW,          /**< gateway (UDP client) ID, 1 byte */
+    HIVE_STORE_COL_DEV,         /**< LoRa device ID, 1 byte */
+    HIVE_STORE_COL_TEMP0,       /**< temperature x 10, 2 bytes each */
+    HIVE_STORE_COL_TEMP1,
+    HIVE_STORE_COL_TEMP2,
+    HIVE_STORE_COL_TEMP3,
+    HIVE_STORE_COL_RH0,         /**< RH. x 10, 2 bytes each */
+    HIVE_STORE_COL_RH1,
+    HIVE_STORE_COL_RH2,
+    HIVE_STORE_COL_RH3,
+    HIVE_STORE_COL_VOL0,        /**< volume x 10, 2 bytes each */
+    HIVE_STORE_COL_VOL1,
+    HIVE_STORE_COL_VOL2,
+    HIVE_STORE_COL_VOL3,
+    HIVE_STORE_COL_WEIGHT,      /**< weight x 100, 2 bytes */
+    HIVE_STORE_NCOLS
+};
+
+struct hive_store_header {
+    uint32_t magic;                             /**< HIVE_STORE_MAGIC */
+    uint16_t version;                           /**< HIVE_STORE_VERSION */
+    uint16_t ncols;                             /**< HIVE_STORE_NCOLS */
+    uint32_t capacity;                          /**< rows per column */
+    uint32_t reserved;
+    _Atomic uint64_t nrows;                     /**< complete rows */
+    int64_t col_min[HIVE_STORE_NCOLS];          /**< min of every column */
+    int64_t col_max[HIVE_STORE_NCOLS];          /**< max of every column */
+    uint64_t col_offset[HIVE_STORE_NCOLS];      /**< file offset of column */
+    uint8_t col_width[HIVE_STORE_NCOLS];        /**< byte width of column */
+    uint64_t gw_mask[4];                        /**< gateway IDs present */
+    uint64_t dev_mask[4];                       /**< device IDs present */
+};
+_Static_assert(sizeof(struct hive_store_header) <= HIVE_STORE_HEADER_SIZE,
+        "hive_store_header too large");
+
+
+
+static inline const char *hive_store_col_name(unsigned col_)
+{
+    static const char *const names[HIVE_STORE_NCOLS] = {
+        "time", "gw", "dev",
+        "temp0", "temp1", "temp2", "temp3",
+        "rh0", "rh1", "rh2", "rh3",
+        "vol0", "vol1", "vol2", "vol3",
+        "weight"
+    };
+
+    return (col_ < HIVE_STORE_NCOLS) ? names[col_] : NULL;
+}
+
+
+
+static inline unsigned hive_store_col_width(unsigned col_)
+{
+    switch (col_) {
+    case HIVE_STORE_COL_TIME:
+        return 8;
+    case HIVE_STORE_COL_GW:
+    case HIVE_STORE_COL_DEV:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+
+
+/** Size of a segment file holding capacity_ rows */
+static inline size_t hive_store_segment_size(uint32_t capacity_, uint64_t *p_offsets_)
+{
+    size_t off = HIVE_STORE_HEADER_SIZE;
+    size_t page = 4096;
+    unsigned i = 0;
+
+    for (i = 0; i < HIVE_STORE_NCOLS; ++i) {
+        if (p_offsets_) {
+            p_offsets_[i] = off;
+        }
+        off += (size_t)capacity_ * hive_store_col_width(i);
+        off  = (off + page - 1) & ~(page - 1);
+    }
+
+    return off;
+}
+
+
+
+static inline bool hive_store_mask_test(const uint64_t *p_mask_, unsigned id_)
+{
+    return (p_mask_[(id_ >> 6) & 3] >> (id_ & 63)) & 1;
+}
+
+
+
+static inline void hive_store_mask_set(uint64_t *p_mask_, unsigned id_)
+{
+    p_mask_[(id_ >> 6) & 3] |= (uint64_t)1 << (id_ & 63);
+    return;
+}
+
+
+
+/** Read-only view of one segment */
+struct hive_store_segment {
+    const uint8_t *p_map;
+    size_t map_size;
+    const struct hive_store_header *p_hdr;
+    uint64_t nrows;         /**< complete rows when opened */
+};
+
+
+
+static inline bool hive_store_segment_open(struct hive_store_segment *p_, const char *p_path_)
+{
+    const struct hive_store_header *p_hdr = NULL;
+    struct stat st;
+    void *p_map = NULL;
+    int fd = -1;
+
+    memset(p_, 0, sizeof(*p_));
+
+    fd = open(p_path_, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) || (size_t)st.st_size < HIVE_STORE_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    p_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == p_map) {
+        return false;
+    }
+
+    p_hdr = (const struct hive_store_header *)p_map;
+    if (HIVE_STORE_MAGIC != p_hdr->magic ||
+            HIVE_STORE_VERSION != p_hdr->version ||
+            HIVE_STORE_NCOLS != p_hdr->ncols ||
+            (size_t)st.st_size < hive_store_segment_size(p_hdr->capacity, NULL)) {
+        munmap(p_map, st.st_size);
+        return false;
+    }
+
+    p_->p_map    = p_map;
+    p_->map_size = st.st_size;
+    p_->p_hdr    = p_hdr;
+    p_->nrows    = atomic_load_explicit(
+            (_Atomic uint64_t *)&p_hdr->nrows, memory_order_acquire);
+
+    return true;
+}
+
+
+
+static inline void hive_store_segment_close(struct hive_store_segment *p_)
+{
+    if (p_->p_map) {
+        munmap((void *)p_->p_map, p_->map_size);
+    }
+    memset(p_, 0, sizeof(*p_));
+
+    return;
+}
+
+
+
+/** Value of column col_ at row row_ */
+static inline int64_t hive_store_get(const struct hive_store_segment *p_,
+        unsigned col_, uint64_t row_)
+{
+    const uint8_t *p = p_->p_map + p_->p_hdr->col_offset[col_];
+    int64_t v64 = 0;
+    uint16_t v16 = 0;
+
+    switch (p_->p_hdr->col_width[col_]) {
+    case 8:
+        memcpy(&v64, p + row_ * 8, 8);
+        return v64;
+    case 2:
+        memcpy(&v16, p + row_ * 2, 2);
+        return v16;
+    default:
+        return p[row_];
+    }
+}
+
+
+
+#endif /* !defined(HIVE_STORE_H_INCLUDED) */
+
+
+
+/* vim: set ts=4 sts=4 sw=4 expandtab autoindent : */
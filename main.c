@@ -5,21 +5,49 @@
  */
 
 
+#define _GNU_SOURCE
+
 /** If you use POSIX style non-block socket, enable this */
 #define ENABLE_POSIX_NONBLOCK
 
 /** Enable debug print */
 //#define ENABLE_DEBUG
 
+/** If you publish decoded records to local consumers via /dev/shm, enable this */
+#define ENABLE_SHM_RING
+
+/** If you keep decoded records in local columnar segment files, enable this */
+#define ENABLE_COLUMN_STORE
+
+/** If you answer latest-value queries from the history table, enable this */
+#define ENABLE_QUERY_SERVER
+
+/** If you let the kernel coalesce bursts of datagrams (UDP_GRO), enable this */
+#define ENABLE_UDP_GRO
+
+/** If you shed packets of misbehaving gateways/devices early, enable this */
+#define ENABLE_RATE_LIMIT
+
+/**
+ * Per-stage cycle profiling (dumped on SIGUSR1 and at exit), enable this
+ * or build with `make PROFILE=1'
+ */
+//#define ENABLE_STAGE_PROFILE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #if defined(ENABLE_POSIX_NONBLOCK)
 #   include <fcntl.h>
 #else /* defined(ENABLE_POSIX_NONBLOCK) */
@@ -28,9 +56,30 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
+#if defined(__x86_64__)
+#   include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#   include <arm_acle.h>
+#endif /* defined(__x86_64__) */
+
+#include "shm_ring.h"
+#include "hive_capture.h"
+#include "hive_store.h"
+
+#if !defined(SOL_UDP)
+#   define SOL_UDP (17)
+#endif /* !defined(SOL_UDP) */
+#if !defined(UDP_GRO)
+#   define UDP_GRO (104)
+#endif /* !defined(UDP_GRO) */
+
 
 
 #define LORA_HEADER_SIZE  (3)
@@ -38,10 +87,22 @@
 #define LORA_PACKET_SIZE  (LORA_HEADER_SIZE + LORA_PAYLOAD_SIZE)
 #define MAX_LORA_CLIENTS  (100)
 
-#define UDP_PROTOCOL_VERSION  (0x12)
-#define UDP_PKTID_PUSH_DATA   (0)
+#define UDP_PROTOCOL_VERSION      (0x12)
+#define UDP_PROTOCOL_VERSION_CRC  (0x13)    /**< with CRC32C trailer */
 #define UDP_HEADER_SIZE       (4)
+#define UDP_EXT_HEADER_SIZE   (6)   /**< B == 0: 16-bit length follows D */
+#define UDP_CRC_SIZE          (4)
 #define UDP_PACKET_SIZE       (UDP_HEADER_SIZE + LORA_PACKET_SIZE)
+#define UDP_PACKET_SIZE_CRC   (UDP_PACKET_SIZE + UDP_CRC_SIZE)
+#define UDP_BATCH_MAX_READINGS  (255)
+#define UDP_MAX_PACKET_SIZE   (UDP_EXT_HEADER_SIZE + 1 + \
+        UDP_BATCH_MAX_READINGS * LORA_PACKET_SIZE + UDP_CRC_SIZE)
+enum tag_UDP_PKTIDS {
+    UDP_PKTID_PUSH_DATA = 0,    /**< one LoRa reading */
+    UDP_PKTID_BATCH_DATA,       /**< count + several LoRa readings */
+    UDP_PKTID_HEARTBEAT,        /**< gateway is alive, no reading */
+    MAX_UDP_PKTIDS
+};
 enum tag_UDP_CLIENT_IDS {
     UDP_CLIENT_ID_DUMMY = 0,
     UDP_CLIENT_ID_MAIN,
@@ -50,17 +111,47 @@ enum tag_UDP_CLIENT_IDS {
 
 #define UDP_SERVER_PORT (50812)
 #define UDP_SERVER_ADDR ("127.0.0.1")
+#define MAX_LISTENERS   (8)             /**< -l given at most */
 #define UDP_SERVER_TIMEOUT_SEC  (3)
 #define UDP_SERVER_TIMEOUT_USEC (0)
 
+#define BUSY_POLL_USEC      (50)        /**< SO_BUSY_POLL in low-latency mode */
+#define BUSY_SPIN_COUNT     (1 << 16)   /**< empty polls spent spinning */
+#define BUSY_YIELD_COUNT    (1 << 10)   /**< then yielding, then sleep in select() */
+
 #define UDP_BUFSIZE (256)
+#define UDP_GRO_BUFSIZE (65536)         /**< receive buffer for coalesced datagrams */
+#define UDP_RCVBUF_SIZE (4 * 1024 * 1024)   /**< SO_RCVBUF(FORCE), absorbs bursts */
+#define UDP_DRAIN_MAX   (64)            /**< recvmmsg() per wakeup at most */
+#define UDP_RX_BATCH    (16)            /**< datagrams per recvmmsg() */
+#if defined(ENABLE_UDP_GRO)
+#   define UDP_RX_SLOTSIZE (UDP_GRO_BUFSIZE)
+#else /* defined(ENABLE_UDP_GRO) */
+#   define UDP_RX_SLOTSIZE (UDP_MAX_PACKET_SIZE)
+#endif /* defined(ENABLE_UDP_GRO) */
 #define CSV_BUFSIZE (512)
 
+#define DEDUP_WINDOW        (64)   /**< serials remembered per device (< 128) */
+#define DEDUP_RESYNC_COUNT  (4)    /**< consecutive stale serials taken as reboot */
+#define DEDUP_MAX_AGE_SEC   (60)   /**< silence after which the window is stale */
+
+#define RATE_LIMIT_DEVICE_PPS     (2)     /**< sustained packets/sec per device */
+#define RATE_LIMIT_DEVICE_BURST   (64)    /**< bucket depth per device (a gateway flush) */
+#define RATE_LIMIT_GATEWAY_PPS    (200)   /**< sustained packets/sec per gateway */
+#define RATE_LIMIT_GATEWAY_BURST  (400)   /**< bucket depth per gateway */
+
+#define QUERY_SERVER_PORT (50813)
+#define QUERY_SERVER_ADDR ("127.0.0.1")
+#define QUERY_BUFSIZE     (60000)   /**< max reply datagram size */
+
 
 
 #if !defined(MAX_)
 #   define MAX_(a,b) (a<b?b:a)
 #endif /* !defined(MAX_) */
+#if !defined(MIN_)
+#   define MIN_(a,b) (a<b?a:b)
+#endif /* !defined(MIN_) */
 
 
 
@@ -94,11 +185,134 @@ static struct delegate_plugin g_delegate_[MAX_UDP_CLIENT_IDS];
 
 
 
-static uint8_t g_lora_histories_[MAX_UDP_CLIENT_IDS][MAX_LORA_CLIENTS][LORA_PACKET_SIZE];
+enum tag_RECORD_SINK_IDS {
+    RECORD_SINK_ID_SHM_RING = 0,
+    RECORD_SINK_ID_COLUMN_STORE,
+    MAX_RECORD_SINK_IDS
+};
+
+/** Sink of decoded records (in addition to the CSV delegate plugin) */
+struct record_sink {
+    /** [opt] Initalizing handler */
+    bool (*p_init_fn)(
+            struct record_sink *p_          /**< [in,out] record sink info */
+            );
+    /** [opt] De-initalizing hander */
+    void (*p_deinit_fn)(
+            struct record_sink *p_          /**< [in,out] record sink info */
+            );
+    /** [must] Publishing handler */
+    bool (*p_publish_fn)(
+            struct record_sink *p_,         /**< [in,out] record sink info */
+            const struct hive_record *p_rec_    /**< [in] decoded record */
+            );
+    /** [opt] User data */
+    void *p_user;
+};
+static struct record_sink g_sinks_[MAX_RECORD_SINK_IDS];
+static unsigned g_nsinks_ = 0;  /**< number of active sinks */
+
+
+
+/**
+ * Most recent packet of every (gateway, device).
+ *
+ * Only the receive loop writes; other threads (query server) read it
+ * under the seqlock, so they never block the writer.
+ */
+struct lora_history {
+    _Atomic uint32_t seq;       /**< seqlock, odd while updating */
+    uint32_t reserved;
+    uint64_t rx_mono_ns;        /**< arrival time (CLOCK_MONOTONIC), 0 if never */
+    uint8_t packet[LORA_PACKET_SIZE];
+};
+static struct lora_history g_lora_histories_[MAX_UDP_CLIENT_IDS][MAX_LORA_CLIENTS];
+
+
+
+enum tag_DEDUP_RESULTS {
+    DEDUP_NEW = 0,      /**< newer than anything seen, forward */
+    DEDUP_REORDERED,    /**< older but not seen yet, forward */
+    DEDUP_DUPLICATE,    /**< seen already, drop */
+    DEDUP_STALE         /**< older than the window, drop */
+};
+
+/**
+ * Serial number replay window and link quality counters of a device.
+ *
+ * Counters are written by the receive loop only; readers on other threads
+ * see approximate values.
+ */
+struct lora_dedup {
+    uint64_t window;        /**< bit i set: serial (top - i) already seen */
+    uint8_t top;            /**< highest serial seen */
+    uint8_t valid;          /**< window initialized */
+    uint8_t nstale;         /**< consecutive stale serials */
+    uint8_t reserved;
+    uint32_t received;      /**< packets passed validation */
+    uint32_t accepted;      /**< packets forwarded */
+    uint32_t duplicates;    /**< dropped, serial already seen */
+    uint32_t stale;         /**< dropped, serial older than the window */
+    uint32_t reordered;     /**< forwarded, serial arrived out of order */
+    uint32_t lost;          /**< serials skipped and never arrived (yet) */
+};
+static struct lora_dedup g_lora_dedups_[MAX_UDP_CLIENT_IDS][MAX_LORA_CLIENTS];
+
+
+
+/**
+ * Server socket (-l, default UDP_SERVER_ADDR:UDP_SERVER_PORT)
+ *
+ * All listeners feed the same history, dedup state and metrics; each has
+ * its own receive pool.
+ */
+struct listener {
+    char spec[64];                  /**< as given, e.g. "[::1]:50812" */
+    struct sockaddr_storage ss;     /**< address to bind */
+    socklen_t sslen;                /**< size of ss in byte */
+    uint16_t port;                  /**< port (host byte order) */
+    int fd;                         /**< socket FD */
+    struct rx_pool *p_pool;         /**< receive buffers */
+};
+static struct listener g_listeners_[MAX_LISTENERS];
+static unsigned g_nlisteners_ = 0;
+
+
+
+/** Admission control token bucket, refilled lazily on use */
+struct token_bucket {
+    uint32_t tokens;        /**< available tokens x 1000 */
+    uint32_t last_ms;       /**< last refill (CLOCK_MONOTONIC, ms, wraps) */
+    uint32_t throttled;     /**< packets shed */
+};
+static struct token_bucket g_device_buckets_[MAX_UDP_CLIENT_IDS][MAX_LORA_CLIENTS];
+static struct token_bucket g_gateway_buckets_[MAX_UDP_CLIENT_IDS];
+
+/** Token bucket parameters (-d for devices, -r for gateways) */
+struct rate_limit {
+    uint32_t pps;           /**< sustained packets/sec, 0: unlimited */
+    uint32_t burst;         /**< bucket depth */
+};
+static struct rate_limit g_device_limit_ = {
+    RATE_LIMIT_DEVICE_PPS, RATE_LIMIT_DEVICE_BURST
+};
+static struct rate_limit g_gateway_limit_ = {
+    RATE_LIMIT_GATEWAY_PPS, RATE_LIMIT_GATEWAY_BURST
+};
+
+
+
+/** Gateway liveness from UDP_PKTID_HEARTBEAT (read by the query server) */
+struct gateway_heartbeat {
+    _Atomic uint32_t count;         /**< heartbeats received */
+    _Atomic uint64_t last_mono_ns;  /**< last one (CLOCK_MONOTONIC) */
+};
+static struct gateway_heartbeat g_gateway_heartbeats_[MAX_UDP_CLIENT_IDS];
 
 
 
 static volatile sig_atomic_t g_do_term_ = 0;
+static volatile sig_atomic_t g_do_prof_dump_ = 0;
 
 
 
@@ -110,6 +324,319 @@ static void sig_handler(int sig)
 
 
 
+#if defined(ENABLE_STAGE_PROFILE)
+static void sig_handler_usr1(int sig)
+{
+    (void)sig;
+    g_do_prof_dump_ = 1;
+    return;
+}
+#endif /* defined(ENABLE_STAGE_PROFILE) */
+
+
+
+static uint64_t monotonic_ns_(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+
+
+static uint64_t realtime_ns_(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+
+
+/*
+ * Log-linear histogram
+ *
+ *  Values below 2^LOG_HIST_SUB_BITS get a bucket each, above that every
+ *  power of 2 is split into 2^LOG_HIST_SUB_BITS buckets (about 6% wide).
+ */
+#define LOG_HIST_SUB_BITS (4)
+#define LOG_HIST_BUCKETS  ((64 - LOG_HIST_SUB_BITS + 1) << LOG_HIST_SUB_BITS)
+
+struct log_hist {
+    uint64_t count[LOG_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+/** Kernel receive to forwarded latency of the receive loop (ns) */
+static struct log_hist g_latency_hist_;
+
+
+
+static unsigned log_hist_index_(uint64_t v_)
+{
+    unsigned e = 0;
+
+    if (v_ < (1U << LOG_HIST_SUB_BITS)) {
+        return v_;
+    }
+    e = 63 - __builtin_clzll(v_);
+
+    return ((e - LOG_HIST_SUB_BITS + 1) << LOG_HIST_SUB_BITS)
+        | ((v_ >> (e - LOG_HIST_SUB_BITS)) & ((1U << LOG_HIST_SUB_BITS) - 1));
+}
+
+
+
+/** Smallest value that falls into bucket idx_ */
+static uint64_t log_hist_lower_(unsigned idx_)
+{
+    unsigned e = 0;
+
+    if (idx_ < (1U << LOG_HIST_SUB_BITS)) {
+        return idx_;
+    }
+    e = (idx_ >> LOG_HIST_SUB_BITS) + LOG_HIST_SUB_BITS - 1;
+
+    return (uint64_t)((1U << LOG_HIST_SUB_BITS) |
+            (idx_ & ((1U << LOG_HIST_SUB_BITS) - 1))) << (e - LOG_HIST_SUB_BITS);
+}
+
+
+
+static void log_hist_add_(struct log_hist *p_, uint64_t v_)
+{
+    ++p_->count[log_hist_index_(v_)];
+    ++p_->total;
+    if (p_->max < v_) {
+        p_->max = v_;
+    }
+
+    return;
+}
+
+
+
+/** Value at quantile q_ (0.0 .. 1.0), reported as the bucket's upper edge */
+static uint64_t log_hist_quantile_(const struct log_hist *p_, double q_)
+{
+    uint64_t rank = (uint64_t)(q_ * p_->total + 0.5);
+    uint64_t seen = 0;
+    unsigned i = 0;
+
+    if (!rank) {
+        rank = 1;
+    }
+    for (i = 0; i < LOG_HIST_BUCKETS; ++i) {
+        seen += p_->count[i];
+        if (rank <= seen) {
+            uint64_t upper = (i + 1 < LOG_HIST_BUCKETS) ?
+                log_hist_lower_(i + 1) - 1 : p_->max;
+
+            return MIN_(upper, p_->max);
+        }
+    }
+
+    return p_->max;
+}
+
+
+
+/*
+ * Per-stage profiling
+ *
+ *  PROF_BEGIN() / PROF_END() around a stage record its duration into a
+ *  histogram of the calling thread.  Without ENABLE_STAGE_PROFILE they
+ *  compile to nothing.  Durations are TSC cycles on x86, ns elsewhere.
+ */
+enum tag_PROF_STAGES {
+    PROF_STAGE_RECV = 0,    /**< recvmsg() */
+    PROF_STAGE_VALIDATE,    /**< header and CRC validation */
+    PROF_STAGE_ADMISSION,   /**< token buckets */
+    PROF_STAGE_DEDUP,       /**< replay window and history update */
+    PROF_STAGE_PUBLISH,     /**< record sinks */
+    PROF_STAGE_CSV,         /**< p_generate_csv_fn */
+    PROF_STAGE_SEND,        /**< p_send_to_server_fn */
+    MAX_PROF_STAGES
+};
+
+#if defined(ENABLE_STAGE_PROFILE)
+#   if defined(__x86_64__) || defined(__i386__)
+#       include <x86intrin.h>
+#       define PROF_UNIT ("cycles")
+#       define prof_now_() (__rdtsc())
+#   else /* defined(__x86_64__) || defined(__i386__) */
+#       define PROF_UNIT ("ns")
+#       define prof_now_() (monotonic_ns_())
+#   endif /* defined(__x86_64__) || defined(__i386__) */
+#   define PROF_BEGIN(stage_) \
+        const uint64_t prof_t0_##stage_ = prof_now_()
+#   define PROF_END(stage_) \
+        prof_record_((stage_), prof_now_() - prof_t0_##stage_)
+
+struct prof_table {
+    struct log_hist hist[MAX_PROF_STAGES];
+    struct prof_table *p_next;      /**< all tables, for dumping */
+    char name[16];                  /**< thread name */
+};
+static struct prof_table *g_prof_tables_ = NULL;
+static pthread_mutex_t g_prof_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct prof_table *tp_prof_ = NULL;
+
+static const char *const g_prof_stage_names_[MAX_PROF_STAGES] = {
+    "recv", "validate", "admission", "dedup", "publish", "csv", "send"
+};
+
+
+
+/** Give calling thread its own table (lazily done by prof_record_() too) */
+static void prof_attach_(const char *p_name_)
+{
+    struct prof_table *p_table = NULL;
+
+    if (tp_prof_) {
+        return;
+    }
+    p_table = calloc(1, sizeof(*p_table));
+    if (!p_table) {
+        return;
+    }
+    snprintf(p_table->name, sizeof(p_table->name), "%s", p_name_);
+
+    pthread_mutex_lock(&g_prof_lock_);
+    p_table->p_next = g_prof_tables_;
+    g_prof_tables_  = p_table;
+    pthread_mutex_unlock(&g_prof_lock_);
+
+    tp_prof_ = p_table;
+
+    return;
+}
+
+
+
+static void prof_record_(unsigned stage_, uint64_t ticks_)
+{
+    if (!tp_prof_) {
+        prof_attach_("thread");
+        if (!tp_prof_) {
+            return;
+        }
+    }
+    log_hist_add_(&tp_prof_->hist[stage_], ticks_);
+
+    return;
+}
+
+
+
+/**
+ * Print breakdown per thread name (threads of the same name are summed,
+ * tables are read while being updated)
+ */
+static void prof_dump_(void)
+{
+    static struct log_hist hist[MAX_PROF_STAGES];
+
+    const struct prof_table *p_table = NULL;
+    const struct prof_table *p_other = NULL;
+
+    pthread_mutex_lock(&g_prof_lock_);
+    for (p_table = g_prof_tables_; p_table; p_table = p_table->p_next) {
+        uint64_t sum[MAX_PROF_STAGES] = { 0 };
+        uint64_t total = 0;
+        unsigned i = 0;
+        unsigned j = 0;
+
+        for (p_other = g_prof_tables_; p_other != p_table; p_other = p_other->p_next) {
+            if (!strcmp(p_other->name, p_table->name)) {
+                break;
+            }
+        }
+        if (p_other != p_table) {
+            continue;   /* summed up already */
+        }
+
+        memset(hist, 0, sizeof(hist));
+        for ( ; p_other; p_other = p_other->p_next) {
+            if (strcmp(p_other->name, p_table->name)) {
+                continue;
+            }
+            for (i = 0; i < MAX_PROF_STAGES; ++i) {
+                for (j = 0; j < LOG_HIST_BUCKETS; ++j) {
+                    hist[i].count[j] += p_other->hist[i].count[j];
+                }
+                hist[i].total += p_other->hist[i].total;
+                hist[i].max    = MAX_(hist[i].max, p_other->hist[i].max);
+            }
+        }
+
+        for (i = 0; i < MAX_PROF_STAGES; ++i) {
+            /* sum of bucket lower edges, good to ~6% */
+            for (j = 0; j < LOG_HIST_BUCKETS; ++j) {
+                sum[i] += hist[i].count[j] * log_hist_lower_(j);
+            }
+            total += sum[i];
+        }
+        if (!total) {
+            continue;
+        }
+
+        fprintf(stderr, "profile [%s] (%s)\n", p_table->name, PROF_UNIT);
+        fprintf(stderr, "  %-10s %12s %10s %10s %10s %10s %6s\n",
+                "stage", "count", "mean", "p50", "p99", "max", "share");
+        for (i = 0; i < MAX_PROF_STAGES; ++i) {
+            const struct log_hist *p_hist = &hist[i];
+
+            if (!p_hist->total) {
+                continue;
+            }
+            fprintf(stderr, "  %-10s %12lu %10lu %10lu %10lu %10lu %5.1lf%%\n"
+                    , g_prof_stage_names_[i]
+                    , (unsigned long)p_hist->total
+                    , (unsigned long)(sum[i] / p_hist->total)
+                    , (unsigned long)log_hist_quantile_(p_hist, 0.50)
+                    , (unsigned long)log_hist_quantile_(p_hist, 0.99)
+                    , (unsigned long)p_hist->max
+                    , 100.0 * sum[i] / total);
+        }
+    }
+    pthread_mutex_unlock(&g_prof_lock_);
+
+    return;
+}
+
+
+
+static void prof_cleanup_(void)
+{
+    struct prof_table *p_table = NULL;
+
+    pthread_mutex_lock(&g_prof_lock_);
+    while (g_prof_tables_) {
+        p_table = g_prof_tables_;
+        g_prof_tables_ = p_table->p_next;
+        free(p_table);
+    }
+    pthread_mutex_unlock(&g_prof_lock_);
+    tp_prof_ = NULL;
+
+    return;
+}
+#else /* defined(ENABLE_STAGE_PROFILE) */
+#   define PROF_BEGIN(stage_)
+#   define PROF_END(stage_)     do { } while (0)
+#   define prof_attach_(name_)  do { } while (0)
+#   define prof_dump_()         do { } while (0)
+#   define prof_cleanup_()      do { } while (0)
+#endif /* defined(ENABLE_STAGE_PROFILE) */
+
+
+
 static double le16_to_double_(const uint8_t *p_)
 {
     uint16_t v = *(const uint16_t *)p_;
@@ -160,6 +687,82 @@ static double be32_to_double_(const uint8_t *p_)
 
 
 
+static uint16_t be16_to_uint16_(const uint8_t *p_)
+{
+    assert(p_);
+
+    return (uint16_t)((p_[0] << 8) | p_[1]);
+}
+
+
+
+static uint16_t le16_to_uint16_(const uint8_t *p_)
+{
+    assert(p_);
+
+    return (uint16_t)(p_[0] | (p_[1] << 8));
+}
+
+
+
+static uint32_t be32_to_uint32_(const uint8_t *p_)
+{
+    assert(p_);
+
+    return ((uint32_t)p_[0] << 24)
+        | ((uint32_t)p_[1] << 16)
+        | ((uint32_t)p_[2] <<  8)
+        |  (uint32_t)p_[3];
+}
+
+
+
+static uint32_t le32_to_uint32_(const uint8_t *p_)
+{
+    assert(p_);
+
+    return (uint32_t)p_[0]
+        | ((uint32_t)p_[1] <<  8)
+        | ((uint32_t)p_[2] << 16)
+        | ((uint32_t)p_[3] << 24);
+}
+
+
+
+/**
+ * Decode LoRa packet into raw integer fields (see admit_() for format)
+ *
+ * rx_time_ns is left 0, the caller fills it if it knows the arrival time.
+ */
+static void decode_lora_(unsigned udp_id_, const uint8_t *p_lora_,
+        struct hive_record *p_rec_)
+{
+    int i = 0;
+
+    assert(p_lora_);
+    assert(p_rec_);
+
+    memset(p_rec_, 0, sizeof(*p_rec_));
+
+    p_rec_->gw_id  = udp_id_;
+    p_rec_->dev_id = p_lora_[0];
+    p_rec_->serial = p_lora_[1];
+    memcpy(p_rec_->datetime, &p_lora_[3], sizeof(p_rec_->datetime));
+
+    p_rec_->lat_n = le32_to_uint32_(&p_lora_[9]);
+    p_rec_->lon_e = le32_to_uint32_(&p_lora_[13]);
+    for (i = 0; i < 4; ++i) {
+        p_rec_->temp[i] = le16_to_uint16_(&p_lora_[17 + 2 * i]);
+        p_rec_->rh[i]   = le16_to_uint16_(&p_lora_[25 + 2 * i]);
+        p_rec_->vol[i]  = le16_to_uint16_(&p_lora_[33 + 2 * i]);
+    }
+    p_rec_->weight = le16_to_uint16_(&p_lora_[41]);
+
+    return;
+}
+
+
+
 #define UDP_MIKE_SERVER_PORT (50910)
 #define UDP_MIKE_SERVER_ADDR ("127.0.0.1")
 
@@ -341,121 +944,3233 @@ static bool send_to_server_mike_(struct delegate_plugin *p_, const char *p_csv_)
 
 
 
-static bool delegate_(size_t len_, const uint8_t *p_udp_)
+/**
+ * Check serial number N against the replay window of a device
+ *
+ * Serials are 8 bit and wrap, so "newer" means ahead by 1..127 (serial
+ * number arithmetic).  Anything DEDUP_WINDOW or more behind is stale,
+ * unless it keeps coming DEDUP_RESYNC_COUNT times in a row, which means
+ * the device restarted its serial.
+ *
+ * 8 bits wrap quickly, so the window alone can't tell a retransmission
+ * from a device that skipped 128 or more serials (outage) or restarted
+ * them: it is resynced instead when a serial at or behind the top carries
+ * a DATE/TIME newer than the latest reading, which a retransmission can't.
+ * Once the device was silent for DEDUP_MAX_AGE_SEC (now_ns_ != 0) the
+ * window itself is stale; then only a newer DATE/TIME resyncs, the latest
+ * reading again is a duplicate and anything else is stale.
+ */
+static int dedup_check_(struct lora_dedup *p_, const uint8_t *p_lora_,
+        const struct lora_history *p_hist_, uint64_t now_ns_)
 {
-    static char csv[CSV_BUFSIZE];
+    const uint8_t serial = p_lora_[1];
+    int diff = 0;
+    int cmp = 0;
 
-    uint8_t *p_hist = NULL;
-    const uint8_t *p_lora = NULL;
+    assert(p_);
+    assert(p_lora_);
+    assert(p_hist_);
 
-    uint8_t udp_id = 0;
-    uint8_t lora_id = 0;
+    ++p_->received;
 
-    assert(len_);
-    assert(p_udp_);
+    if (!p_->valid) {
+        goto resync;
+    }
 
-    /*
-     * UDP packet format:
-     *
-     *  |<----------- B bytes ----------->|
-     *  |               |<-- B-4 bytes -->|
-     *  +---+---+---+---+-----.......-----+
-     *  | A | B | C | D |        E        |
-     *  +---+---+---+---+-----.......-----+
-     *
-     *      * A (1 byte) : Protocol version
-     *      * B (1 byte) : Length (from A to E)
-     *      * C (1 byte) : UDP client ID
-     *      * D (1 byte) : Packet type
-     *      * E (B-4 bytes) : LoRa data (max 127 bytes)
+    /* DATE/TIME (yy, mm, dd, HH, MM, SS) compares as bytes */
+    cmp = p_hist_->rx_mono_ns ? memcmp(&p_lora_[3], &p_hist_->packet[3], 6) : 0;
+
+    if (now_ns_ && p_hist_->rx_mono_ns &&
+            (uint64_t)DEDUP_MAX_AGE_SEC * 1000000000 < now_ns_ - p_hist_->rx_mono_ns) {
+        if (0 < cmp) {
+            goto resync;
+        }
+        if (!cmp && serial == p_hist_->packet[1]) {
+            ++p_->duplicates;
+            return DEDUP_DUPLICATE;
+        }
+        goto stale;
+    }
+
+    diff = (int8_t)(uint8_t)(serial - p_->top);
+    if (0 < diff) {
+        p_->lost  += diff - 1;
+        p_->window = (DEDUP_WINDOW <= diff) ? 0 : (p_->window << diff);
+        p_->window |= 1;
+        p_->top    = serial;
+        p_->nstale = 0;
+        ++p_->accepted;
+        return DEDUP_NEW;
+    }
+
+    if (0 < cmp) {
+        goto resync;
+    }
+
+    diff = -diff;
+    if (DEDUP_WINDOW <= diff) {
+        goto stale;
+    }
+
+    p_->nstale = 0;
+    if (p_->window & ((uint64_t)1 << diff)) {
+        ++p_->duplicates;
+        return DEDUP_DUPLICATE;
+    }
+
+    p_->window |= (uint64_t)1 << diff;
+    if (p_->lost) {
+        --p_->lost;
+    }
+    ++p_->reordered;
+    ++p_->accepted;
+    return DEDUP_REORDERED;
+
+stale:
+    if (DEDUP_RESYNC_COUNT <= ++p_->nstale) {
+        goto resync;
+    }
+    ++p_->stale;
+    return DEDUP_STALE;
+
+resync:
+    p_->valid  = 1;
+    p_->top    = serial;
+    p_->window = 1;
+    p_->nstale = 0;
+    ++p_->accepted;
+    return DEDUP_NEW;
+}
+
+
+
+/**
+ * Take one token from bucket
+ *
+ * Tokens are kept x 1000, so a rate of R packets/sec refills exactly R
+ * per millisecond.  An untouched (zeroed) bucket starts full.  A rate of
+ * 0 means no limit.
+ */
+static bool token_bucket_take_(struct token_bucket *p_, uint32_t now_ms_,
+        const struct rate_limit *p_limit_)
+{
+    const uint32_t rate_pps_ = p_limit_->pps;
+    const uint32_t burst_    = p_limit_->burst;
+    uint64_t tokens = 0;
+
+    assert(p_);
+    assert(p_limit_);
+
+    if (!rate_pps_) {
+        return true;
+    }
+
+    tokens = p_->tokens + (uint64_t)(uint32_t)(now_ms_ - p_->last_ms) * rate_pps_;
+    if ((uint64_t)burst_ * 1000 < tokens) {
+        tokens = (uint64_t)burst_ * 1000;
+    }
+    p_->last_ms = now_ms_;
+
+    if (tokens < 1000) {
+        p_->tokens = tokens;
+        ++p_->throttled;
+        return false;
+    }
+    p_->tokens = tokens - 1000;
+
+    return true;
+}
+
+
+
+/**
+ * Parse "PPS[:BURST]" into a rate limit
+ *
+ * PPS 0 disables the limit; BURST defaults to the compiled-in depth, but
+ * no less than PPS.
+ */
+static bool rate_limit_parse_(const char *p_spec_, struct rate_limit *p_)
+{
+    char *p_end = NULL;
+    unsigned long pps = 0;
+    unsigned long burst = 0;
+
+    assert(p_spec_);
+    assert(p_);
+
+    pps = strtoul(p_spec_, &p_end, 10);
+    if (p_end == p_spec_ || UINT32_MAX / 1000 < pps) {
+        return false;
+    }
+    if (':' == *p_end) {
+        const char *p_burst = p_end + 1;
+
+        burst = strtoul(p_burst, &p_end, 10);
+        if (p_end == p_burst || !burst || UINT32_MAX / 1000 < burst) {
+            return false;
+        }
+    } else {
+        burst = (pps < p_->burst) ? p_->burst : pps;
+    }
+    if (*p_end) {
+        return false;
+    }
+    p_->pps   = pps;
+    p_->burst = burst;
+
+    return true;
+}
+
+
+
+/*
+ * CRC32C (Castagnoli)
+ *
+ *  Uses the SSE4.2 / ARMv8 CRC32 instructions when available, slicing-by-8
+ *  tables otherwise.  crc32c_setup_() picks the implementation once.
+ */
+#define CRC32C_POLY (0x82f63b78U)   /* reflected */
+
+static uint32_t g_crc32c_table_[8][256];
+static uint32_t (*g_crc32c_fn_)(uint32_t crc_, const uint8_t *p_, size_t len_);
+
+
+
+static uint32_t crc32c_sw_(uint32_t crc_, const uint8_t *p_, size_t len_)
+{
+    while (len_ && ((uintptr_t)p_ & 7)) {
+        crc_ = g_crc32c_table_[0][(crc_ ^ *p_++) & 0xff] ^ (crc_ >> 8);
+        --len_;
+    }
+    while (8 <= len_) {
+        uint32_t lo = crc_ ^ le32_to_uint32_(p_);
+        uint32_t hi = le32_to_uint32_(p_ + 4);
+
+        crc_ = g_crc32c_table_[7][ lo        & 0xff] ^
+               g_crc32c_table_[6][(lo >>  8) & 0xff] ^
+               g_crc32c_table_[5][(lo >> 16) & 0xff] ^
+               g_crc32c_table_[4][ lo >> 24        ] ^
+               g_crc32c_table_[3][ hi        & 0xff] ^
+               g_crc32c_table_[2][(hi >>  8) & 0xff] ^
+               g_crc32c_table_[1][(hi >> 16) & 0xff] ^
+               g_crc32c_table_[0][ hi >> 24        ];
+        p_   += 8;
+        len_ -= 8;
+    }
+    while (len_--) {
+        crc_ = g_crc32c_table_[0][(crc_ ^ *p_++) & 0xff] ^ (crc_ >> 8);
+    }
+
+    return crc_;
+}
+
+
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_(uint32_t crc_, const uint8_t *p_, size_t len_)
+{
+    uint64_t crc = crc_;
+
+    while (8 <= len_) {
+        uint64_t v = 0;
+
+        memcpy(&v, p_, sizeof(v));
+        crc   = _mm_crc32_u64(crc, v);
+        p_   += 8;
+        len_ -= 8;
+    }
+    if (4 <= len_) {
+        uint32_t v = 0;
+
+        memcpy(&v, p_, sizeof(v));
+        crc   = _mm_crc32_u32(crc, v);
+        p_   += 4;
+        len_ -= 4;
+    }
+    if (2 <= len_) {
+        uint16_t v = 0;
+
+        memcpy(&v, p_, sizeof(v));
+        crc   = _mm_crc32_u16(crc, v);
+        p_   += 2;
+        len_ -= 2;
+    }
+    if (len_) {
+        crc = _mm_crc32_u8(crc, *p_);
+    }
+
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw_(uint32_t crc_, const uint8_t *p_, size_t len_)
+{
+    while (8 <= len_) {
+        uint64_t v = 0;
+
+        memcpy(&v, p_, sizeof(v));
+        crc_  = __crc32cd(crc_, v);
+        p_   += 8;
+        len_ -= 8;
+    }
+    if (4 <= len_) {
+        uint32_t v = 0;
+
+        memcpy(&v, p_, sizeof(v));
+        crc_  = __crc32cw(crc_, v);
+        p_   += 4;
+        len_ -= 4;
+    }
+    if (2 <= len_) {
+        uint16_t v = 0;
+
+        memcpy(&v, p_, sizeof(v));
+        crc_  = __crc32ch(crc_, v);
+        p_   += 2;
+        len_ -= 2;
+    }
+    if (len_) {
+        crc_ = __crc32cb(crc_, *p_);
+    }
+
+    return crc_;
+}
+#endif /* defined(__x86_64__) */
+
+
+
+static void crc32c_setup_(void)
+{
+    unsigned i = 0;
+    unsigned j = 0;
+
+    for (i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+
+        for (j = 0; j < 8; ++j) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        g_crc32c_table_[0][i] = crc;
+    }
+    for (i = 0; i < 256; ++i) {
+        for (j = 1; j < 8; ++j) {
+            g_crc32c_table_[j][i] = g_crc32c_table_[0][g_crc32c_table_[j - 1][i] & 0xff]
+                ^ (g_crc32c_table_[j - 1][i] >> 8);
+        }
+    }
+
+    g_crc32c_fn_ = crc32c_sw_;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        g_crc32c_fn_ = crc32c_hw_;
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    g_crc32c_fn_ = crc32c_hw_;
+#endif /* defined(__x86_64__) */
+
+    return;
+}
+
+
+
+static uint32_t crc32c_(const uint8_t *p_, size_t len_)
+{
+    return ~g_crc32c_fn_(~0U, p_, len_);
+}
+
+
+
+/** Check CRC32C trailer (big endian) of a UDP_PROTOCOL_VERSION_CRC packet */
+static bool crc32c_verify_(const uint8_t *p_udp_, size_t len_)
+{
+    assert(UDP_CRC_SIZE < len_);
+
+    return crc32c_(p_udp_, len_ - UDP_CRC_SIZE) ==
+        be32_to_uint32_(&p_udp_[len_ - UDP_CRC_SIZE]);
+}
+
+
+
+#if defined(__x86_64__)
+/** Four same-length packets at once, so the 3 cycle crc32 latency overlaps */
+__attribute__((target("sse4.2")))
+static void crc32c_hw_x4_(const uint8_t *const pp_[4], size_t len_, uint32_t crc_[4])
+{
+    uint64_t c0 = ~0U, c1 = ~0U, c2 = ~0U, c3 = ~0U;
+    size_t off = 0;
+
+    for (off = 0; off + 8 <= len_; off += 8) {
+        uint64_t v0, v1, v2, v3;
+
+        memcpy(&v0, pp_[0] + off, 8);
+        memcpy(&v1, pp_[1] + off, 8);
+        memcpy(&v2, pp_[2] + off, 8);
+        memcpy(&v3, pp_[3] + off, 8);
+        c0 = _mm_crc32_u64(c0, v0);
+        c1 = _mm_crc32_u64(c1, v1);
+        c2 = _mm_crc32_u64(c2, v2);
+        c3 = _mm_crc32_u64(c3, v3);
+    }
+    if (off + 4 <= len_) {
+        uint32_t v0, v1, v2, v3;
+
+        memcpy(&v0, pp_[0] + off, 4);
+        memcpy(&v1, pp_[1] + off, 4);
+        memcpy(&v2, pp_[2] + off, 4);
+        memcpy(&v3, pp_[3] + off, 4);
+        c0 = _mm_crc32_u32(c0, v0);
+        c1 = _mm_crc32_u32(c1, v1);
+        c2 = _mm_crc32_u32(c2, v2);
+        c3 = _mm_crc32_u32(c3, v3);
+        off += 4;
+    }
+    for ( ; off < len_; ++off) {
+        c0 = _mm_crc32_u8(c0, pp_[0][off]);
+        c1 = _mm_crc32_u8(c1, pp_[1][off]);
+        c2 = _mm_crc32_u8(c2, pp_[2][off]);
+        c3 = _mm_crc32_u8(c3, pp_[3][off]);
+    }
+    crc_[0] = ~c0, crc_[1] = ~c1, crc_[2] = ~c2, crc_[3] = ~c3;
+
+    return;
+}
+#endif /* defined(__x86_64__) */
+
+
+
+/**
+ * Check CRC32C trailers of n_ packets
+ *
+ * pp_udp_[i] / lens_[i] are packets; ok_[i] is set to true when packet i
+ * either carries no CRC or a good one.
+ */
+static void crc32c_verify_batch_(size_t n_, const uint8_t *const *pp_udp_,
+        const size_t *lens_, bool *ok_)
+{
+    size_t i = 0;
+
+    while (i < n_) {
+#if defined(__x86_64__)
+        if (crc32c_hw_ == g_crc32c_fn_ && i + 4 <= n_) {
+            const uint8_t *pp[4] = { pp_udp_[i], pp_udp_[i + 1], pp_udp_[i + 2], pp_udp_[i + 3] };
+            size_t len = lens_[i];
+            uint32_t crc[4];
+            unsigned j = 0;
+
+            for (j = 0; j < 4; ++j) {
+                if (lens_[i + j] != len || len <= UDP_CRC_SIZE ||
+                        UDP_PROTOCOL_VERSION_CRC != pp[j][0]) {
+                    break;
+                }
+            }
+            if (4 == j) {
+                crc32c_hw_x4_(pp, len - UDP_CRC_SIZE, crc);
+                for (j = 0; j < 4; ++j) {
+                    ok_[i + j] = crc[j] == be32_to_uint32_(&pp[j][len - UDP_CRC_SIZE]);
+                }
+                i += 4;
+                continue;
+            }
+        }
+#endif /* defined(__x86_64__) */
+
+        ok_[i] = lens_[i] <= UDP_CRC_SIZE ||
+            UDP_PROTOCOL_VERSION_CRC != pp_udp_[i][0] ||
+            crc32c_verify_(pp_udp_[i], lens_[i]);
+        ++i;
+    }
+
+    return;
+}
+
+
+
+/** User data for record sink of shared memory ring */
+struct shm_ring_info {
+    const char *p_name;         /**< shm object name, NULL: off */
+    int fd;                     /**< shm_open() FD */
+    struct shm_ring *p_ring;    /**< mapped ring */
+    size_t map_size;            /**< size of mapping in byte */
+};
+static struct shm_ring_info g_shm_ring_info = { NULL, -1, NULL, 0 };
+
+
+
+static bool init_shm_ring_(struct record_sink *p_)
+{
+    struct shm_ring_info *p_info = &g_shm_ring_info;
+    size_t map_size = SHM_RING_MAP_SIZE(SHM_RING_SLOTS);
+    struct shm_ring *p_ring = NULL;
+    int fd = -1;
+
+    assert(p_);
+    assert(p_info->p_name);
+    assert(!p_info->p_ring);
+
+    fd = shm_open(p_info->p_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("shm_open() for ring");
+        return false;
+    }
+    if (ftruncate(fd, map_size)) {
+        perror("ftruncate() for ring");
+        close(fd);
+        return false;
+    }
+    p_ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == p_ring) {
+        perror("mmap() for ring");
+        close(fd);
+        return false;
+    }
+
+    /* readers check magic last, so publish it after everything else */
+    atomic_store_explicit(&p_ring->head, 0, memory_order_relaxed);
+    memset(p_ring->slots, 0, map_size - sizeof(*p_ring));
+    p_ring->version   = SHM_RING_VERSION;
+    p_ring->nslots    = SHM_RING_SLOTS;
+    p_ring->slot_size = sizeof(struct shm_ring_slot);
+    atomic_thread_fence(memory_order_release);
+    p_ring->magic     = SHM_RING_MAGIC;
+
+    p_info->fd       = fd;
+    p_info->p_ring   = p_ring;
+    p_info->map_size = map_size;
+
+    p_->p_user = p_info;
+
+    return true;
+}
+
+
+
+static void deinit_shm_ring_(struct record_sink *p_)
+{
+    struct shm_ring_info *p_info = &g_shm_ring_info;
+
+    assert(p_);
+
+    /*
+     * Leave the object in /dev/shm, so consumers already attached keep
+     * their mapping and find the ring again after our restart.
      */
-    if (len_ != UDP_PACKET_SIZE) {
-        fprintf(stderr, "Invalid UDP packet size: %lu\n", len_);
+    if (p_info->p_ring) {
+        munmap(p_info->p_ring, p_info->map_size);
+        p_info->p_ring = NULL;
+    }
+    if (0 <= p_info->fd) {
+        close(p_info->fd);
+        p_info->fd = -1;
+    }
+
+    p_->p_user = NULL;
+
+    return;
+}
+
+
+
+static bool publish_shm_ring_(struct record_sink *p_,
+        const struct hive_record *p_rec_)
+{
+    struct shm_ring_info *p_info = (struct shm_ring_info *)p_->p_user;
+
+    assert(p_);
+    assert(p_rec_);
+    assert(p_info);
+
+    shm_ring_publish(p_info->p_ring, p_rec_);
+
+    return true;
+}
+
+
+
+#if defined(ENABLE_COLUMN_STORE)
+/** Segment file made ahead of time under a temporary name */
+struct column_store_spare {
+    int fd;                             /**< FD, -1 if none */
+    uint8_t *p_map;                     /**< mapped file, NULL if none */
+    char path[PATH_MAX];                /**< temporary name */
+};
+
+/** Full segment to be closed */
+struct column_store_retired {
+    int fd;                             /**< FD, -1 if none */
+    uint8_t *p_map;                     /**< mapped file, NULL if none */
+    uint64_t nrows;                     /**< rows written */
+};
+
+/** User data for record sink of columnar segment store (see hive_store.h) */
+struct column_store_info {
+    const char *p_dir;                  /**< directory of segment files, NULL: off */
+    int fd;                             /**< current segment FD */
+    uint8_t *p_map;                     /**< mapped segment */
+    size_t map_size;                    /**< size of mapping in byte */
+    struct hive_store_header *p_hdr;    /**< header of current segment */
+    uint64_t nrows;                     /**< rows in current segment */
+    int64_t t_end;                      /**< roll over at this time (unix ms) */
+
+    /* segments are made and closed by a thread, off the receive path */
+    pthread_t thread;                   /**< see column_store_thread_() */
+    pthread_mutex_t lock;               /**< protects below */
+    pthread_cond_t cond;                /**< any of below changed */
+    struct column_store_spare spare;    /**< ready to use if p_map */
+    struct column_store_retired retired;    /**< to be closed if p_map */
+    bool want_spare;                    /**< make a spare */
+    bool stop;                          /**< thread should exit */
+};
+static struct column_store_info g_column_store_info = {
+    NULL, -1, NULL, 0, NULL, 0, 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+    .spare = { -1, NULL, "" }, .retired = { -1, NULL, 0 }
+};
+
+
+
+/**
+ * Create a segment file of full capacity at p_path_ and map it
+ *
+ * Blocks are allocated up front: a store to a page the file system can't
+ * back raises SIGBUS, so running out of disk has to show up here instead.
+ *
+ * \return FD, -1 on error, -2 if p_path_ exists (not reported)
+ */
+static int column_store_create_(const char *p_path_, uint8_t **pp_map_)
+{
+    struct hive_store_header *p_hdr = NULL;
+    uint64_t offsets[HIVE_STORE_NCOLS];
+    const size_t map_size = hive_store_segment_size(HIVE_STORE_SEGMENT_ROWS, offsets);
+    uint8_t *p_map = NULL;
+    int fd = -1;
+    int ret = 0;
+    unsigned i = 0;
+
+    fd = open(p_path_, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        if (EEXIST == errno) {
+            return -2;
+        }
+        perror(p_path_);
+        return -1;
+    }
+    ret = posix_fallocate(fd, 0, map_size);
+    if (ret) {
+        fprintf(stderr, "posix_fallocate() for segment: %s\n", strerror(ret));
+        goto fail;
+    }
+    p_map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == p_map) {
+        perror("mmap() for segment");
+        goto fail;
+    }
+
+    /* readers check magic first, so write it after everything else */
+    p_hdr = (struct hive_store_header *)p_map;
+    p_hdr->version  = HIVE_STORE_VERSION;
+    p_hdr->ncols    = HIVE_STORE_NCOLS;
+    p_hdr->capacity = HIVE_STORE_SEGMENT_ROWS;
+    atomic_store_explicit(&p_hdr->nrows, 0, memory_order_relaxed);
+    for (i = 0; i < HIVE_STORE_NCOLS; ++i) {
+        p_hdr->col_min[i]    = INT64_MAX;
+        p_hdr->col_max[i]    = INT64_MIN;
+        p_hdr->col_offset[i] = offsets[i];
+        p_hdr->col_width[i]  = hive_store_col_width(i);
+        /* fault in the first page of the column, so the first rows don't */
+        p_map[offsets[i]] = 0;
+    }
+    atomic_thread_fence(memory_order_release);
+    p_hdr->magic    = HIVE_STORE_MAGIC;
+
+    *pp_map_ = p_map;
+
+    return fd;
+
+fail:
+    close(fd);
+    unlink(p_path_);
+    return -1;
+}
+
+
+
+static void column_store_spare_drop_(struct column_store_spare *p_)
+{
+    if (p_->p_map) {
+        munmap(p_->p_map, hive_store_segment_size(HIVE_STORE_SEGMENT_ROWS, NULL));
+        p_->p_map = NULL;
+    }
+    if (0 <= p_->fd) {
+        close(p_->fd);
+        p_->fd = -1;
+        unlink(p_->path);
+    }
+
+    return;
+}
+
+
+
+/**
+ * Close a segment
+ *
+ * Columns are allocated for the full capacity, so the unused tail of
+ * every column is given back when the segment is closed early.  The file
+ * keeps its size.
+ */
+static void column_store_retire_(struct column_store_retired *p_)
+{
+    const struct hive_store_header *p_hdr = (const struct hive_store_header *)p_->p_map;
+    const size_t map_size = hive_store_segment_size(HIVE_STORE_SEGMENT_ROWS, NULL);
+    const long page = sysconf(_SC_PAGESIZE);
+    unsigned i = 0;
+
+    if (p_->p_map) {
+        for (i = 0; i < HIVE_STORE_NCOLS; ++i) {
+            const uint64_t end = (i + 1 < HIVE_STORE_NCOLS) ?
+                p_hdr->col_offset[i + 1] : map_size;
+            uint64_t used = p_hdr->col_offset[i] + p_->nrows * p_hdr->col_width[i];
+
+            used = (used + page - 1) & ~(uint64_t)(page - 1);
+            if (used < end) {
+                fallocate(p_->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        used, end - used);
+            }
+        }
+        munmap(p_->p_map, map_size);
+        p_->p_map = NULL;
+    }
+    if (0 <= p_->fd) {
+        close(p_->fd);
+        p_->fd = -1;
+    }
+    p_->nrows = 0;
+
+    return;
+}
+
+
+
+/**
+ * Spare segment maker and closer
+ *
+ * Creating, allocating and mapping a segment takes milliseconds, so a
+ * spare is kept ready under a temporary name (not HIVE_STORE_SUFFIX, so
+ * scanners skip it), and column_store_open_() only has to rename it.
+ * Closing one takes about as long, so full segments are closed here too.
+ */
+static void *column_store_thread_(void *p_arg_)
+{
+    struct column_store_info *p_info = (struct column_store_info *)p_arg_;
+
+    pthread_mutex_lock(&p_info->lock);
+    for (;;) {
+        struct column_store_spare spare;
+        struct column_store_retired retired;
+
+        while (!p_info->stop && !p_info->retired.p_map &&
+                (!p_info->want_spare || p_info->spare.p_map)) {
+            pthread_cond_wait(&p_info->cond, &p_info->lock);
+        }
+
+        if (p_info->retired.p_map) {
+            retired = p_info->retired;
+            p_info->retired.fd    = -1;
+            p_info->retired.p_map = NULL;
+            pthread_mutex_unlock(&p_info->lock);
+            column_store_retire_(&retired);
+            pthread_mutex_lock(&p_info->lock);
+            continue;
+        }
+        if (p_info->stop) {
+            break;
+        }
+        p_info->want_spare = false;
+        pthread_mutex_unlock(&p_info->lock);
+
+        /* one spare at a time; a leftover of a crashed run is overwritten */
+        snprintf(spare.path, sizeof(spare.path), "%s/.spare-%ld.tmp",
+                p_info->p_dir, (long)getpid());
+        unlink(spare.path);
+        spare.p_map = NULL;
+        spare.fd    = column_store_create_(spare.path, &spare.p_map);
+        if (spare.fd < 0) {
+            /* column_store_open_() tries again and gives up */
+            spare.fd    = -1;
+            spare.p_map = NULL;
+        }
+
+        pthread_mutex_lock(&p_info->lock);
+        p_info->spare = spare;
+    }
+    pthread_mutex_unlock(&p_info->lock);
+
+    return NULL;
+}
+
+
+
+/** Hand the current segment over to column_store_thread_() to be closed */
+static void column_store_close_(struct column_store_info *p_info_)
+{
+    struct column_store_retired retired = { p_info_->fd, p_info_->p_map, p_info_->nrows };
+
+    p_info_->fd    = -1;
+    p_info_->p_map = NULL;
+    p_info_->p_hdr = NULL;
+    p_info_->nrows = 0;
+    if (!retired.p_map) {
+        return;
+    }
+
+    pthread_mutex_lock(&p_info_->lock);
+    if (!p_info_->stop && !p_info_->retired.p_map) {
+        p_info_->retired = retired;
+        retired.p_map    = NULL;
+        pthread_cond_signal(&p_info_->cond);
+    }
+    pthread_mutex_unlock(&p_info_->lock);
+
+    /* the thread is gone or still busy with the previous one */
+    if (retired.p_map) {
+        column_store_retire_(&retired);
+    }
+
+    return;
+}
+
+
+
+/** Start a new segment for records from t_ms_ on */
+static bool column_store_open_(struct column_store_info *p_info_, int64_t t_ms_)
+{
+    const int64_t span_ms = (int64_t)HIVE_STORE_SEGMENT_SEC * 1000;
+    struct column_store_spare spare;
+    char path[PATH_MAX];
+    uint8_t *p_map = NULL;
+    int64_t name_ms = t_ms_;
+    int fd = -1;
+
+    assert(!p_info_->p_map);
+
+    /* take the spare, and have the next one made */
+    pthread_mutex_lock(&p_info_->lock);
+    spare = p_info_->spare;
+    p_info_->spare.fd    = -1;
+    p_info_->spare.p_map = NULL;
+    p_info_->want_spare  = true;
+    pthread_cond_signal(&p_info_->cond);
+    pthread_mutex_unlock(&p_info_->lock);
+
+    /* name is the first timestamp, bumped if a segment of that name exists */
+    for (;;) {
+        snprintf(path, sizeof(path), "%s/%013lld%s",
+                p_info_->p_dir, (long long)name_ms, HIVE_STORE_SUFFIX);
+        if (spare.p_map) {
+            if (!link(spare.path, path)) {
+                unlink(spare.path);
+                fd    = spare.fd;
+                p_map = spare.p_map;
+                break;
+            }
+            if (EEXIST != errno) {
+                /* no hard links here? create it in place */
+                perror("link() for segment");
+                column_store_spare_drop_(&spare);
+                continue;
+            }
+        } else {
+            /* no spare (yet), pay for it here */
+            fd = column_store_create_(path, &p_map);
+            if (-2 != fd) {
+                break;
+            }
+        }
+        ++name_ms;
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    p_info_->fd       = fd;
+    p_info_->p_map    = p_map;
+    p_info_->map_size = hive_store_segment_size(HIVE_STORE_SEGMENT_ROWS, NULL);
+    p_info_->p_hdr    = (struct hive_store_header *)p_map;
+    p_info_->nrows    = 0;
+    /* segments by time are aligned to HIVE_STORE_SEGMENT_SEC boundaries */
+    p_info_->t_end    = (t_ms_ / span_ms + 1) * span_ms;
+
+    return true;
+}
+
+
+
+static bool init_column_store_(struct record_sink *p_)
+{
+    struct column_store_info *p_info = &g_column_store_info;
+    int ret = 0;
+
+    assert(p_);
+    assert(p_info->p_dir);
+    assert(!p_info->p_map);
+
+    if (mkdir(p_info->p_dir, 0755) && EEXIST != errno) {
+        perror("mkdir() for column store");
+        return false;
+    }
+
+    /* the first segment is named by the first record, but made now */
+    p_info->stop       = false;
+    p_info->want_spare = true;
+    ret = pthread_create(&p_info->thread, NULL, column_store_thread_, p_info);
+    if (ret) {
+        fprintf(stderr, "pthread_create() for column store: %s\n", strerror(ret));
+        return false;
+    }
+    p_->p_user = p_info;
+
+    return true;
+}
+
+
+
+static void deinit_column_store_(struct record_sink *p_)
+{
+    struct column_store_info *p_info = &g_column_store_info;
+
+    assert(p_);
+
+    if (!p_->p_user) {
+        return;
+    }
+
+    pthread_mutex_lock(&p_info->lock);
+    p_info->stop = true;
+    pthread_cond_signal(&p_info->cond);
+    pthread_mutex_unlock(&p_info->lock);
+    pthread_join(p_info->thread, NULL);
+
+    column_store_spare_drop_(&p_info->spare);
+    column_store_retire_(&p_info->retired);
+    column_store_close_(p_info);
+    p_->p_user = NULL;
+
+    return;
+}
+
+
+
+static bool publish_column_store_(struct record_sink *p_,
+        const struct hive_record *p_rec_)
+{
+    struct column_store_info *p_info = (struct column_store_info *)p_->p_user;
+    struct hive_store_header *p_hdr = NULL;
+    int64_t values[HIVE_STORE_NCOLS];
+    int64_t t_ms = 0;
+    uint64_t row = 0;
+    unsigned i = 0;
+
+    assert(p_);
+    assert(p_rec_);
+    assert(p_info);
+
+    t_ms = (int64_t)(p_rec_->rx_time_ns / 1000000);
+    if (p_info->p_map &&
+            (HIVE_STORE_SEGMENT_ROWS <= p_info->nrows || p_info->t_end <= t_ms)) {
+        column_store_close_(p_info);
+    }
+    if (!p_info->p_map && !column_store_open_(p_info, t_ms)) {
+        /* most likely out of disk; don't try for every record */
+        fprintf(stderr, "column store: no segment for records, disabled\n");
+        p_->p_publish_fn = NULL;
+        --g_nsinks_;
+        return false;
+    }
+
+    values[HIVE_STORE_COL_TIME]   = t_ms;
+    values[HIVE_STORE_COL_GW]     = p_rec_->gw_id;
+    values[HIVE_STORE_COL_DEV]    = p_rec_->dev_id;
+    for (i = 0; i < 4; ++i) {
+        values[HIVE_STORE_COL_TEMP0 + i] = p_rec_->temp[i];
+        values[HIVE_STORE_COL_RH0 + i]   = p_rec_->rh[i];
+        values[HIVE_STORE_COL_VOL0 + i]  = p_rec_->vol[i];
+    }
+    values[HIVE_STORE_COL_WEIGHT] = p_rec_->weight;
+
+    p_hdr = p_info->p_hdr;
+    row   = p_info->nrows;
+    for (i = 0; i < HIVE_STORE_NCOLS; ++i) {
+        uint8_t *p_col = p_info->p_map + p_hdr->col_offset[i];
+        const int64_t v = values[i];
+
+        switch (p_hdr->col_width[i]) {
+        case 8:
+            memcpy(&p_col[row * 8], &v, 8);
+            break;
+        case 2: {
+            const uint16_t v16 = (uint16_t)v;
+            memcpy(&p_col[row * 2], &v16, 2);
+            break;
+        }
+        default:
+            p_col[row] = (uint8_t)v;
+            break;
+        }
+        p_hdr->col_min[i] = MIN_(p_hdr->col_min[i], v);
+        p_hdr->col_max[i] = MAX_(p_hdr->col_max[i], v);
+    }
+    hive_store_mask_set(p_hdr->gw_mask, p_rec_->gw_id);
+    hive_store_mask_set(p_hdr->dev_mask, p_rec_->dev_id);
+
+    /* the row becomes visible to scanners here */
+    p_info->nrows = row + 1;
+    atomic_store_explicit(&p_hdr->nrows, p_info->nrows, memory_order_release);
+
+    return true;
+}
+#endif /* defined(ENABLE_COLUMN_STORE) */
+
+
+
+#define ADMIT_RATE_LIMIT    (1U << 0)   /**< apply admission control */
+#define ADMIT_CRC_VERIFIED  (1U << 1)   /**< CRC trailer checked already */
+#define ADMIT_LIVE          (1U << 2)   /**< received now, age dedup windows */
+#define ADMIT_BATCHED       (1U << 3)   /**< from batch data, no device bucket */
+
+/**
+ * Run one LoRa reading through admission control and dedup
+ *
+ * Safe to call from several threads as long as each (gateway, device) is
+ * handled by one thread only and ADMIT_RATE_LIMIT isn't given.
+ *
+ * \retval true  new or late reading, to be forwarded
+ * \retval false invalid, throttled or duplicate
+ */
+static bool admit_(unsigned udp_id_, const uint8_t *p_lora_, unsigned flags_)
+{
+    struct lora_history *p_hist = NULL;
+    uint64_t now_ns = (flags_ & ADMIT_LIVE) ? monotonic_ns_() : 0;
+    uint32_t seq = 0;
+
+    uint8_t udp_id = udp_id_;
+    uint8_t lora_id = 0;
+
+    assert(p_lora_);
+
+    /*
+     * LoRa data format:
+     *
+     *  All multi-byte fields are big endian.
+     *
+     *  |<------------------------ 43 bytes -------------------------->|
+     *  |<- 3 bytes ->|<---------------- 40 bytes -------------------->|
+     *  +----+---+----+------+------+-----+--------+------+-------+----+
+     *  | ID | N | PI | DATE | TIME | GPS | TEMPx4 | RHx4 | VOLx4 | WT |
+     *  +----+---+----+------+------+-----+--------+------+-------+----+
+     *
+     *      * Header (3 bytes)
+     *          * ID (1 byte) : Device ID
+     *          * N (1 byte) : Packet serial number
+     *          * PI (1 byte) : Reserved (always 1)
+     *      * Payload (40 bytes)
+     *          * DATE (3 bytes) year, month, day
+     *          * TIME (3 bytes) hour, minute, second
+     *          * GPS (8 bytes) lat-N (4 bytes), lon-E (4 bytes)
+     *          * TEMPx4 (8 bytes) temperature (each 2 bytes) x 4
+     *          * RHx4 (8 bytes) RH. (each 2 bytes) x 4
+     *          * VOLx4 (8 bytes) volume (each 2 bytes) x 4
+     *          * WT (2 bytes) weight
+     */
+    lora_id = p_lora_[0];
+    if (MAX_LORA_CLIENTS <= lora_id) {
+        fprintf(stderr, "Invalid LoRa client ID: %u\n", lora_id);
+        return false;
+    }
+
+#if defined(ENABLE_RATE_LIMIT)
+    if (flags_ & ADMIT_RATE_LIMIT) {    /* shed misbehaving senders before doing any real work */
+        uint32_t now_ms = monotonic_ns_() / 1000000;
+        PROF_BEGIN(PROF_STAGE_ADMISSION);
+
+        if ((!(flags_ & ADMIT_BATCHED) &&
+                    !token_bucket_take_(&g_device_buckets_[udp_id][lora_id], now_ms,
+                        &g_device_limit_)) ||
+                !token_bucket_take_(&g_gateway_buckets_[udp_id], now_ms,
+                    &g_gateway_limit_)) {
+#if defined(ENABLE_DEBUG)
+            fprintf(stderr, "throttled: %02u-%02u\n", udp_id, lora_id);
+#endif /* defined(ENABLE_DEBUG) */
+            PROF_END(PROF_STAGE_ADMISSION);
+            return false;
+        }
+        PROF_END(PROF_STAGE_ADMISSION);
+    }
+#endif /* defined(ENABLE_RATE_LIMIT) */
+
+    PROF_BEGIN(PROF_STAGE_DEDUP);
+    p_hist = &g_lora_histories_[udp_id][lora_id];
+    switch (dedup_check_(&g_lora_dedups_[udp_id][lora_id], p_lora_, p_hist, now_ns)) {
+    case DEDUP_NEW:
+        /* new data arrival, keep it as the latest */
+#if defined(ENABLE_DEBUG)
+        fprintf(stderr, "new data arrival\n");
+#endif /* defined(ENABLE_DEBUG) */
+        seq = atomic_load_explicit(&p_hist->seq, memory_order_relaxed);
+        atomic_store_explicit(&p_hist->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(p_hist->packet, p_lora_, LORA_PACKET_SIZE);
+        p_hist->rx_mono_ns = monotonic_ns_();
+        atomic_store_explicit(&p_hist->seq, seq + 2, memory_order_release);
+        break;
+
+    case DEDUP_REORDERED:
+        /* late arrival, forward it but don't roll back the latest */
+#if defined(ENABLE_DEBUG)
+        fprintf(stderr, "reordered data arrival\n");
+#endif /* defined(ENABLE_DEBUG) */
+        break;
+
+    default:
+#if defined(ENABLE_DEBUG)
+        fprintf(stderr, "same data exists\n");
+#endif /* defined(ENABLE_DEBUG) */
+        PROF_END(PROF_STAGE_DEDUP);
+        return false;
+    }
+    PROF_END(PROF_STAGE_DEDUP);
+
+    return true;
+}
+
+
+
+/** UDP packet split into its fields */
+struct udp_frame {
+    unsigned udp_id;        /**< C: UDP client ID */
+    unsigned type;          /**< D: packet type (UDP_PKTID_xxx) */
+    const uint8_t *p_data;  /**< E */
+    size_t data_len;        /**< size of E in byte */
+};
+
+/** Where the readings of a packet go */
+struct reading_ctx {
+    unsigned flags;         /**< ADMIT_xxx */
+    unsigned sub;           /**< batch data: reading sub - 1 only (0: all) */
+    unsigned nreadings;     /**< readings taken by p_reading_fn */
+    /** [must] Called for every admitted reading */
+    bool (*p_reading_fn)(
+            struct reading_ctx *p_,         /**< [in,out] this context */
+            unsigned udp_id_,               /**< [in] UDP client ID */
+            const uint8_t *p_lora_          /**< [in] LoRa data */
+            );
+    /** [opt] User data */
+    void *p_user;
+};
+
+
+
+static void take_reading_(struct reading_ctx *p_ctx_, unsigned udp_id_,
+        const uint8_t *p_lora_)
+{
+    if (admit_(udp_id_, p_lora_, p_ctx_->flags) &&
+            p_ctx_->p_reading_fn(p_ctx_, udp_id_, p_lora_)) {
+        ++p_ctx_->nreadings;
+    }
+
+    return;
+}
+
+
+
+/** UDP_PKTID_PUSH_DATA: E is one LoRa reading */
+static bool handle_push_data_(const struct udp_frame *p_frame_, struct reading_ctx *p_ctx_)
+{
+    take_reading_(p_ctx_, p_frame_->udp_id, p_frame_->p_data);
+
+    return true;
+}
+
+
+
+/**
+ * UDP_PKTID_BATCH_DATA: E is a count K (1 byte) and K LoRa readings
+ *
+ *  +---+---------+---------+-----+-----------+
+ *  | K | LoRa #0 | LoRa #1 | ... | LoRa #K-1 |
+ *  +---+---------+---------+-----+-----------+
+ *
+ *  Readings go through admission control and dedup one by one, in order,
+ *  as if they came in separate packets, except that they don't take from
+ *  the device bucket: a batch is a gateway flushing stored readings, which
+ *  are never sent again.  The gateway bucket still applies.
+ */
+static bool handle_batch_data_(const struct udp_frame *p_frame_, struct reading_ctx *p_ctx_)
+{
+    const unsigned count = p_frame_->p_data[0];
+    const unsigned flags = p_ctx_->flags;
+    unsigned first = 0;
+    unsigned last = count;
+    unsigned i = 0;
+
+    if (!count || p_frame_->data_len != 1 + (size_t)count * LORA_PACKET_SIZE) {
+        fprintf(stderr, "Invalid batch data: %u readings in %lu bytes\n",
+                count, (unsigned long)p_frame_->data_len);
+        return false;
+    }
+    if (p_ctx_->sub) {
+        if (count < p_ctx_->sub) {
+            return false;
+        }
+        first = p_ctx_->sub - 1;
+        last  = p_ctx_->sub;
+    }
+
+    p_ctx_->flags |= ADMIT_BATCHED;
+    for (i = first; i < last; ++i) {
+        take_reading_(p_ctx_, p_frame_->udp_id,
+                &p_frame_->p_data[1 + i * LORA_PACKET_SIZE]);
+    }
+    p_ctx_->flags = flags;
+
+    return true;
+}
+
+
+
+/**
+ * UDP_PKTID_HEARTBEAT: no reading, E (if any) is ignored
+ *
+ * A heartbeat still takes a token from its gateway bucket, so a gateway
+ * can't flood us with them.
+ */
+static bool handle_heartbeat_(const struct udp_frame *p_frame_, struct reading_ctx *p_ctx_)
+{
+    struct gateway_heartbeat *p_hb = &g_gateway_heartbeats_[p_frame_->udp_id];
+
+#if defined(ENABLE_RATE_LIMIT)
+    if ((p_ctx_->flags & ADMIT_RATE_LIMIT) &&
+            !token_bucket_take_(&g_gateway_buckets_[p_frame_->udp_id],
+                monotonic_ns_() / 1000000, &g_gateway_limit_)) {
+#if defined(ENABLE_DEBUG)
+        fprintf(stderr, "throttled: %02u heartbeat\n", p_frame_->udp_id);
+#endif /* defined(ENABLE_DEBUG) */
+        return false;
+    }
+#else
+    (void)p_ctx_;
+#endif /* defined(ENABLE_RATE_LIMIT) */
+
+    atomic_fetch_add_explicit(&p_hb->count, 1, memory_order_relaxed);
+    atomic_store_explicit(&p_hb->last_mono_ns, monotonic_ns_(), memory_order_relaxed);
+
+    return true;
+}
+
+
+
+/** Packet type dispatch table entry */
+struct packet_handler {
+    size_t min_len;         /**< size of E at least */
+    size_t max_len;         /**< size of E at most */
+    /** [must] Handle a validated packet of this type */
+    bool (*p_handle_fn)(
+            const struct udp_frame *p_frame_,   /**< [in] packet */
+            struct reading_ctx *p_ctx_          /**< [in,out] readings go here */
+            );
+};
+static const struct packet_handler g_packet_handlers_[MAX_UDP_PKTIDS] = {
+    [UDP_PKTID_PUSH_DATA]  = { LORA_PACKET_SIZE, LORA_PACKET_SIZE, handle_push_data_ },
+    [UDP_PKTID_BATCH_DATA] = { 1 + LORA_PACKET_SIZE,
+        1 + UDP_BATCH_MAX_READINGS * LORA_PACKET_SIZE, handle_batch_data_ },
+    [UDP_PKTID_HEARTBEAT]  = { 0, UDP_MAX_PACKET_SIZE, handle_heartbeat_ },
+};
+
+
+
+/**
+ * Split UDP packet into its fields and check them (CRC excluded)
+ *
+ * \return NULL if fine, otherwise what's wrong
+ */
+static const char *udp_frame_parse_(size_t len_, const uint8_t *p_udp_,
+        struct udp_frame *p_frame_)
+{
+    size_t hdrsize = UDP_HEADER_SIZE;
+    size_t pktsize = 0;
+    size_t crcsize = 0;
+
+    /*
+     * UDP packet format:
+     *
+     *  |<----------- B bytes ----------->|
+     *  |               |<-- B-4 bytes -->|
+     *  +---+---+---+---+-----.......-----+
+     *  | A | B | C | D |        E        |
+     *  +---+---+---+---+-----.......-----+
+     *
+     *      * A (1 byte) : Protocol version
+     *      * B (1 byte) : Length (from A to E)
+     *      * C (1 byte) : UDP client ID
+     *      * D (1 byte) : Packet type
+     *      * E (B-4 bytes) : data of the packet type (see g_packet_handlers_)
+     *
+     *  With A == UDP_PROTOCOL_VERSION_CRC, E is followed by CRC32C of A..E
+     *  (4 bytes, big endian), and B counts it too.
+     *
+     *  Packets longer than 255 bytes have B == 0 and the length as 2 bytes
+     *  (big endian) after D, then E:
+     *
+     *  +---+---+---+---+---+---+-----.......-----+
+     *  | A | 0 | C | D | length|        E        |
+     *  +---+---+---+---+---+---+-----.......-----+
+     */
+    if (len_ < UDP_HEADER_SIZE) {
+        return "Invalid UDP packet size";
+    }
+    if (p_udp_[0] != UDP_PROTOCOL_VERSION && p_udp_[0] != UDP_PROTOCOL_VERSION_CRC) {
+        return "Invalid UDP packet format";
+    }
+    pktsize = p_udp_[1];
+    if (!pktsize) {
+        if (len_ < UDP_EXT_HEADER_SIZE) {
+            return "Invalid UDP packet size";
+        }
+        hdrsize = UDP_EXT_HEADER_SIZE;
+        pktsize = be16_to_uint16_(&p_udp_[4]);
+    }
+    crcsize = (UDP_PROTOCOL_VERSION_CRC == p_udp_[0]) ? UDP_CRC_SIZE : 0;
+    if (len_ != pktsize || pktsize < hdrsize + crcsize) {
+        return "Invalid UDP packet size";
+    }
+
+    p_frame_->udp_id   = p_udp_[2];
+    p_frame_->type     = p_udp_[3];
+    p_frame_->p_data   = &p_udp_[hdrsize];
+    p_frame_->data_len = pktsize - hdrsize - crcsize;
+
+    if (MAX_UDP_PKTIDS <= p_frame_->type ||
+            p_frame_->data_len < g_packet_handlers_[p_frame_->type].min_len ||
+            g_packet_handlers_[p_frame_->type].max_len < p_frame_->data_len) {
+        return "Invalid UDP packet format";
+    }
+    if (MAX_UDP_CLIENT_IDS <= p_frame_->udp_id ||
+            !g_delegate_[p_frame_->udp_id].p_generate_csv_fn) {
+        return "Invalid UDP client ID";
+    }
+
+    return NULL;
+}
+
+
+
+/**
+ * Validate UDP packet and hand it to the handler of its type
+ *
+ * Readings in it are admitted (see admit_()) and passed to
+ * p_ctx_->p_reading_fn; p_ctx_->nreadings counts them.
+ *
+ * \retval true  valid packet (readings may still have been dropped)
+ * \retval false invalid packet
+ */
+static bool dispatch_(size_t len_, const uint8_t *p_udp_, struct reading_ctx *p_ctx_)
+{
+    struct udp_frame frame;
+    const char *p_err = NULL;
+
+    assert(p_udp_);
+    assert(p_ctx_);
+    assert(p_ctx_->p_reading_fn);
+
+    p_ctx_->nreadings = 0;
+
+    {
+        PROF_BEGIN(PROF_STAGE_VALIDATE);
+
+        p_err = udp_frame_parse_(len_, p_udp_, &frame);
+        if (p_err) {
+            fprintf(stderr, "%s: %lu bytes, type %u\n", p_err,
+                    (unsigned long)len_, (UDP_HEADER_SIZE <= len_) ? p_udp_[3] : 0);
+            return false;
+        }
+        if (UDP_PROTOCOL_VERSION_CRC == p_udp_[0] &&
+                !(p_ctx_->flags & ADMIT_CRC_VERIFIED) && !crc32c_verify_(p_udp_, len_)) {
+            fprintf(stderr, "Invalid UDP packet CRC\n");
+            return false;
+        }
+        PROF_END(PROF_STAGE_VALIDATE);
+    }
+
+    return g_packet_handlers_[frame.type].p_handle_fn(&frame, p_ctx_);
+}
+
+
+
+/** Live path reading: publish to record sinks, generate CSV and forward it */
+static bool forward_reading_(struct reading_ctx *p_ctx_, unsigned udp_id_,
+        const uint8_t *p_lora_)
+{
+    static char csv[CSV_BUFSIZE];
+
+    (void)p_ctx_;
+
+    if (g_nsinks_) {
+        struct hive_record rec;
+        int i = 0;
+        PROF_BEGIN(PROF_STAGE_PUBLISH);
+
+        decode_lora_(udp_id_, p_lora_, &rec);
+        rec.rx_time_ns = realtime_ns_();
+        for (i = 0; i < MAX_RECORD_SINK_IDS; ++i) {
+            if (g_sinks_[i].p_publish_fn &&
+                    !g_sinks_[i].p_publish_fn(&g_sinks_[i], &rec)) {
+                fprintf(stderr, "Publish record failed: sink %d\n", i);
+            }
+        }
+        PROF_END(PROF_STAGE_PUBLISH);
+    }
+
+    {
+        PROF_BEGIN(PROF_STAGE_CSV);
+
+        assert(g_delegate_[udp_id_].p_generate_csv_fn);
+        if (!g_delegate_[udp_id_].p_generate_csv_fn(&g_delegate_[udp_id_],
+                    p_lora_, sizeof(csv), csv)) {
+            fprintf(stderr, "Generate CSV failed\n");
+            return false;
+        }
+        PROF_END(PROF_STAGE_CSV);
+    }
+
+    {
+        PROF_BEGIN(PROF_STAGE_SEND);
+
+        assert(g_delegate_[udp_id_].p_send_to_server_fn);
+        if (!g_delegate_[udp_id_].p_send_to_server_fn(&g_delegate_[udp_id_], csv)) {
+            fprintf(stderr, "Send CSV failed\n");
+            return false;
+        }
+        PROF_END(PROF_STAGE_SEND);
+    }
+
+    return true;
+}
+
+
+
+/**
+ * Handle one received datagram
+ *
+ * flags_ may have ADMIT_CRC_VERIFIED, when the caller checked CRC already.
+ *
+ * \return true if any reading in it was forwarded
+ */
+static bool delegate_(size_t len_, const uint8_t *p_udp_, unsigned flags_)
+{
+    struct reading_ctx ctx;
+
+    assert(p_udp_);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.flags        = ADMIT_RATE_LIMIT | ADMIT_LIVE | flags_;
+    ctx.p_reading_fn = forward_reading_;
+    dispatch_(len_, p_udp_, &ctx);
+
+    return 0 < ctx.nreadings;
+}
+
+
+
+static void cleanup_delegate_(void)
+{
+    int i = 0;
+
+    for (i = 0; i < MAX_UDP_CLIENT_IDS; ++i) {
+        if (g_delegate_[i].p_deinit_fn) {
+            g_delegate_[i].p_deinit_fn(i, &g_delegate_[i]);
+        }
+    }
+
+    return;
+}
+
+
+
+static bool setup_delegate_(void)
+{
+    unsigned i = 0;
+
+    memset(g_delegate_, 0, sizeof(g_delegate_));
+
+    for (i = 0; i < MAX_UDP_CLIENT_IDS; ++i) {
+        switch (i) {
+        case UDP_CLIENT_ID_DUMMY:
+#if defined(ENABLE_DEBUG)
+            fprintf(stderr, "dummy device id %u, skipped\n", i);
+#endif /* defined(ENABLE_DEBUG) */
+            break;
+
+        case UDP_CLIENT_ID_MAIN:
+            g_delegate_[i].p_init_fn           = init_mike_;
+            g_delegate_[i].p_deinit_fn         = deinit_mike_;
+            g_delegate_[i].p_generate_csv_fn   = generate_csv_mike_;
+            g_delegate_[i].p_send_to_server_fn = send_to_server_mike_;
+            if (!g_delegate_[i].p_init_fn(i, &g_delegate_[i])) {
+                cleanup_delegate_();
+                return false;
+            }
+            break;
+
+        default:
+#if defined(ENABLE_DEBUG)
+            fprintf(stderr, "unknown device id %u, skipped\n", i);
+#endif /* defined(ENABLE_DEBUG) */
+            break;
+        }
+    }
+
+    return true;
+}
+
+
+
+static void cleanup_sinks_(void)
+{
+    int i = 0;
+
+    for (i = 0; i < MAX_RECORD_SINK_IDS; ++i) {
+        if (g_sinks_[i].p_deinit_fn) {
+            g_sinks_[i].p_deinit_fn(&g_sinks_[i]);
+        }
+    }
+    memset(g_sinks_, 0, sizeof(g_sinks_));
+    g_nsinks_ = 0;
+
+    return;
+}
+
+
+
+static bool setup_sinks_(void)
+{
+    unsigned i = 0;
+
+    memset(g_sinks_, 0, sizeof(g_sinks_));
+    g_nsinks_ = 0;
+
+    for (i = 0; i < MAX_RECORD_SINK_IDS; ++i) {
+        switch (i) {
+        case RECORD_SINK_ID_SHM_RING:
+#if defined(ENABLE_SHM_RING)
+            if (!g_shm_ring_info.p_name) {
+                break;      /* opt-in by -R */
+            }
+            g_sinks_[i].p_init_fn    = init_shm_ring_;
+            g_sinks_[i].p_deinit_fn  = deinit_shm_ring_;
+            g_sinks_[i].p_publish_fn = publish_shm_ring_;
+#endif /* defined(ENABLE_SHM_RING) */
+            break;
+
+        case RECORD_SINK_ID_COLUMN_STORE:
+#if defined(ENABLE_COLUMN_STORE)
+            if (!g_column_store_info.p_dir) {
+                break;      /* opt-in by -S */
+            }
+            g_sinks_[i].p_init_fn    = init_column_store_;
+            g_sinks_[i].p_deinit_fn  = deinit_column_store_;
+            g_sinks_[i].p_publish_fn = publish_column_store_;
+#endif /* defined(ENABLE_COLUMN_STORE) */
+            break;
+
+        default:
+            break;
+        }
+
+        if (!g_sinks_[i].p_publish_fn) {
+#if defined(ENABLE_DEBUG)
+            fprintf(stderr, "record sink %u disabled, skipped\n", i);
+#endif /* defined(ENABLE_DEBUG) */
+            continue;
+        }
+        if (g_sinks_[i].p_init_fn && !g_sinks_[i].p_init_fn(&g_sinks_[i])) {
+            memset(&g_sinks_[i], 0, sizeof(g_sinks_[i]));
+            cleanup_sinks_();
+            return false;
+        }
+        ++g_nsinks_;
+    }
+
+    return true;
+}
+
+
+
+/**
+ * Parse "ADDR:PORT" or "[ADDR6]:PORT" into a socket address
+ *
+ * ADDR "*" (or empty) is any IPv4 address, "[::]" any IPv6 address.
+ */
+static bool parse_endpoint_(const char *p_spec_,
+        struct sockaddr_storage *p_ss_, socklen_t *p_sslen_, uint16_t *p_port_)
+{
+    char host[INET6_ADDRSTRLEN];
+    const char *p_host = p_spec_;
+    const char *p_port = NULL;
+    char *p_end = NULL;
+    size_t hostlen = 0;
+    bool v6 = false;
+    long port = 0;
+
+    assert(p_spec_);
+    assert(p_ss_);
+    assert(p_sslen_);
+    assert(p_port_);
+
+    if ('[' == p_spec_[0]) {
+        const char *p_close = strchr(p_spec_, ']');
+
+        if (!p_close || ':' != p_close[1]) {
+            return false;
+        }
+        v6      = true;
+        p_host  = p_spec_ + 1;
+        hostlen = p_close - p_host;
+        p_port  = p_close + 2;
+    } else {
+        p_port = strrchr(p_spec_, ':');
+        if (!p_port) {
+            return false;
+        }
+        hostlen = p_port - p_host;
+        ++p_port;
+    }
+    if (sizeof(host) <= hostlen) {
+        return false;
+    }
+    memcpy(host, p_host, hostlen);
+    host[hostlen] = '\0';
+    port = strtol(p_port, &p_end, 10);
+    if (!*p_port || *p_end || port <= 0 || 65535 < port) {
+        return false;
+    }
+
+    memset(p_ss_, 0, sizeof(*p_ss_));
+    if (v6) {
+        struct sockaddr_in6 *p_sa6 = (struct sockaddr_in6 *)p_ss_;
+
+        p_sa6->sin6_family = AF_INET6;
+        p_sa6->sin6_port   = htons(port);
+        if (1 != inet_pton(AF_INET6, host, &p_sa6->sin6_addr)) {
+            return false;
+        }
+        *p_sslen_ = sizeof(*p_sa6);
+    } else {
+        struct sockaddr_in *p_sa = (struct sockaddr_in *)p_ss_;
+
+        p_sa->sin_family = AF_INET;
+        p_sa->sin_port   = htons(port);
+        if (!host[0] || !strcmp(host, "*")) {
+            p_sa->sin_addr.s_addr = htonl(INADDR_ANY);
+        } else if (1 != inet_pton(AF_INET, host, &p_sa->sin_addr.s_addr)) {
+            return false;
+        }
+        *p_sslen_ = sizeof(*p_sa);
+    }
+    *p_port_ = port;
+
+    return true;
+}
+
+
+
+#if defined(ENABLE_QUERY_SERVER)
+/** Copy one history entry consistently (seqlock reader side) */
+static void read_history_(unsigned udp_id_, unsigned lora_id_,
+        uint64_t *p_rx_mono_ns_, uint8_t *p_packet_)
+{
+    const struct lora_history *p_hist = &g_lora_histories_[udp_id_][lora_id_];
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+
+    assert(udp_id_ < MAX_UDP_CLIENT_IDS);
+    assert(lora_id_ < MAX_LORA_CLIENTS);
+
+    do {
+        s1 = atomic_load_explicit(
+                (_Atomic uint32_t *)&p_hist->seq, memory_order_acquire);
+        if (s1 & 1) {
+            continue;
+        }
+        memcpy(p_packet_, p_hist->packet, LORA_PACKET_SIZE);
+        *p_rx_mono_ns_ = p_hist->rx_mono_ns;
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(
+                (_Atomic uint32_t *)&p_hist->seq, memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+
+    return;
+}
+
+
+
+/**
+ * Append one history entry to reply as CSV line
+ *
+ *  "GW-DEV,AgeSec,yymmddHHMMSS,Lon,Lat,Tem1,Hum1,Vol1,...,Tem4,Hum4,Vol4,Weight"
+ *
+ * \return number of bytes appended, 0 if entry is empty, -1 if no space.
+ */
+static int append_history_csv_(unsigned udp_id_, unsigned lora_id_,
+        uint64_t now_, uint64_t min_age_ns_, size_t bufsize_, char *p_buf_)
+{
+    uint8_t packet[LORA_PACKET_SIZE];
+    uint64_t rx_mono_ns = 0;
+    struct hive_record rec;
+    int ret = 0;
+
+    read_history_(udp_id_, lora_id_, &rx_mono_ns, packet);
+    if (!rx_mono_ns || now_ - rx_mono_ns < min_age_ns_) {
+        return 0;
+    }
+    decode_lora_(udp_id_, packet, &rec);
+
+    ret = snprintf(p_buf_, bufsize_,
+            "%02u-%02u"                     /* gw_id-lora_id */
+            ",%.3lf"                        /* seconds since arrival */
+            ",%02u%02u%02u%02u%02u%02u"     /* yymmddHHMMSS */
+            ",%lf,%lf"                      /* Lon,Lat */
+            ",%lf,%lf,%lf"                  /* Tem1,Hum1,Vol1 */
+            ",%lf,%lf,%lf"                  /* Tem2,Hum2,Vol2 */
+            ",%lf,%lf,%lf"                  /* Tem3,Hum3,Vol3 */
+            ",%lf,%lf,%lf"                  /* Tem4,Hum4,Vol4 */
+            ",%lf\n"                        /* Weight */
+            , rec.gw_id, rec.dev_id
+            , (double)(now_ - rx_mono_ns) / 1000000000
+            , rec.datetime[0], rec.datetime[1], rec.datetime[2]
+            , rec.datetime[3], rec.datetime[4], rec.datetime[5]
+            , (double)rec.lon_e / 1000000, (double)rec.lat_n / 1000000
+            , (double)rec.temp[0] / 10, (double)rec.rh[0] / 10, (double)rec.vol[0] / 10
+            , (double)rec.temp[1] / 10, (double)rec.rh[1] / 10, (double)rec.vol[1] / 10
+            , (double)rec.temp[2] / 10, (double)rec.rh[2] / 10, (double)rec.vol[2] / 10
+            , (double)rec.temp[3] / 10, (double)rec.rh[3] / 10, (double)rec.vol[3] / 10
+            , (double)rec.weight / 100
+            );
+    if (ret < 0 || bufsize_ <= (size_t)ret) {
+        return -1;
+    }
+
+    return ret;
+}
+
+
+
+/**
+ * Append link quality counters of one device to reply as CSV line
+ *
+ *  "GW-DEV,Received,Accepted,Duplicates,Stale,Reordered,Lost,Throttled"
+ *
+ * \return number of bytes appended, 0 if device never seen, -1 if no space.
+ */
+static int append_stats_csv_(unsigned udp_id_, unsigned lora_id_,
+        size_t bufsize_, char *p_buf_)
+{
+    const struct lora_dedup *p_dedup = &g_lora_dedups_[udp_id_][lora_id_];
+    uint32_t throttled = g_device_buckets_[udp_id_][lora_id_].throttled;
+    int ret = 0;
+
+    if (!p_dedup->received && !throttled) {
+        return 0;
+    }
+
+    ret = snprintf(p_buf_, bufsize_, "%02u-%02u,%u,%u,%u,%u,%u,%u,%u\n"
+            , udp_id_, lora_id_
+            , p_dedup->received, p_dedup->accepted, p_dedup->duplicates
+            , p_dedup->stale, p_dedup->reordered, p_dedup->lost, throttled);
+    if (ret < 0 || bufsize_ <= (size_t)ret) {
+        return -1;
+    }
+
+    return ret;
+}
+
+
+
+/**
+ * Build reply for one query
+ *
+ *  Query (text, one per datagram):
+ *      "latest GW DEV" : latest reading of device DEV of gateway GW
+ *      "gateway GW"    : latest readings of all devices of gateway GW
+ *      "silent SEC"    : devices whose last reading is older than SEC
+ *      "stats GW"      : link quality counters of all devices of gateway GW
+ *      "heartbeat"     : heartbeat count and age of every gateway
+ *
+ *  Reply: one CSV line per device (see append_history_csv_() and
+ *  append_stats_csv_()), one "GW,Heartbeats,AgeSec" line per gateway for
+ *  heartbeat, or a single "error,..." line.  A reply that doesn't fit a datagram ends
+ *  with "truncated".
+ */
+static size_t answer_query_(const char *p_query_, size_t bufsize_, char *p_buf_)
+{
+    char cmd[16] = { 0 };
+    unsigned gw = 0;
+    unsigned dev = 0;
+    double sec = 0.0;
+    unsigned gw_begin = 0;
+    unsigned gw_end = 0;
+    unsigned dev_begin = 0;
+    unsigned dev_end = MAX_LORA_CLIENTS;
+    bool stats = false;
+    uint64_t min_age_ns = 0;
+    uint64_t now = monotonic_ns_();
+    size_t len = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+    int ret = 0;
+
+    assert(p_query_);
+    assert(bufsize_);
+    assert(p_buf_);
+
+    if (1 != sscanf(p_query_, "%15s", cmd)) {
+        goto bad_query;
+    }
+
+    if (!strcmp(cmd, "latest")) {
+        if (2 != sscanf(p_query_, "%*s %u %u", &gw, &dev) ||
+                MAX_UDP_CLIENT_IDS <= gw || MAX_LORA_CLIENTS <= dev) {
+            goto bad_query;
+        }
+        gw_begin = gw, gw_end = gw + 1;
+        dev_begin = dev, dev_end = dev + 1;
+
+    } else if (!strcmp(cmd, "gateway")) {
+        if (1 != sscanf(p_query_, "%*s %u", &gw) || MAX_UDP_CLIENT_IDS <= gw) {
+            goto bad_query;
+        }
+        gw_begin = gw, gw_end = gw + 1;
+
+    } else if (!strcmp(cmd, "silent")) {
+        if (1 != sscanf(p_query_, "%*s %lf", &sec) || sec < 0) {
+            goto bad_query;
+        }
+        gw_begin = 0, gw_end = MAX_UDP_CLIENT_IDS;
+        min_age_ns = (uint64_t)(sec * 1000000000);
+
+    } else if (!strcmp(cmd, "heartbeat")) {
+        for (i = 0; i < MAX_UDP_CLIENT_IDS; ++i) {
+            const struct gateway_heartbeat *p_hb = &g_gateway_heartbeats_[i];
+            uint32_t count = atomic_load_explicit(&p_hb->count, memory_order_relaxed);
+            uint64_t last = atomic_load_explicit(&p_hb->last_mono_ns, memory_order_relaxed);
+
+            if (count) {
+                len += snprintf(&p_buf_[len], bufsize_ - len, "%02u,%u,%.1lf\n",
+                        i, count, (double)((last < now) ? now - last : 0) / 1000000000);
+            }
+        }
+        if (!len) {
+            len = snprintf(p_buf_, bufsize_, "error,not found\n");
+        }
+        return len;
+
+    } else if (!strcmp(cmd, "stats")) {
+        if (1 != sscanf(p_query_, "%*s %u", &gw) || MAX_UDP_CLIENT_IDS <= gw) {
+            goto bad_query;
+        }
+        gw_begin = gw, gw_end = gw + 1;
+        stats = true;
+
+    } else {
+        goto bad_query;
+    }
+
+    for (i = gw_begin; i < gw_end; ++i) {
+        for (j = dev_begin; j < dev_end; ++j) {
+            /* keep room for "truncated\n" */
+            if (stats) {
+                ret = append_stats_csv_(i, j, bufsize_ - len - 11, &p_buf_[len]);
+            } else {
+                ret = append_history_csv_(i, j, now, min_age_ns,
+                        bufsize_ - len - 11, &p_buf_[len]);
+            }
+            if (ret < 0) {
+                len += sprintf(&p_buf_[len], "truncated\n");
+                return len;
+            }
+            len += ret;
+        }
+    }
+    if (!len) {
+        len = snprintf(p_buf_, bufsize_, "error,not found\n");
+    }
+
+    return len;
+
+bad_query:
+    return snprintf(p_buf_, bufsize_, "error,bad query\n");
+}
+
+
+
+/** Query server thread: serves queries on its own socket */
+static void *query_server_main_(void *p_arg_)
+{
+    static char query[UDP_BUFSIZE];
+    static char reply[QUERY_BUFSIZE];
+
+    int socket_fd = *(const int *)p_arg_;
+
+    fd_set rfds;
+    struct timeval tv;
+    int ret = -1;
+
+    for ( ; !g_do_term_; ) {
+        struct sockaddr_storage ss;
+        socklen_t sslen = sizeof(ss);
+        ssize_t nr = -1;
+        size_t len = 0;
+
+        FD_ZERO(&rfds);
+        FD_SET(socket_fd, &rfds);
+        tv.tv_sec  = UDP_SERVER_TIMEOUT_SEC;
+        tv.tv_usec = UDP_SERVER_TIMEOUT_USEC;
+        ret = select(socket_fd + 1, &rfds, NULL, NULL, &tv);
+        if (ret <= 0) {
+            continue;
+        }
+
+        nr = recvfrom(socket_fd, query, sizeof(query) - 1, 0,
+                (struct sockaddr *)&ss, &sslen);
+        if (nr <= 0) {
+            continue;
+        }
+        query[nr] = '\0';
+
+        len = answer_query_(query, sizeof(reply), reply);
+        if (sendto(socket_fd, reply, len, 0,
+                    (struct sockaddr *)&ss, sslen) != (ssize_t)len) {
+            perror("sendto() for query");
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/** Start query server thread on "ADDR:PORT" or "[ADDR6]:PORT" */
+static bool setup_query_server_(const char *p_spec_,
+        pthread_t *p_thread_, int *p_fd_)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen = 0;
+    uint16_t port = 0;
+    sigset_t set;
+    sigset_t oldset;
+    int fd = -1;
+    int ret = -1;
+
+    assert(p_spec_);
+    assert(p_thread_);
+    assert(p_fd_);
+
+    if (!parse_endpoint_(p_spec_, &ss, &sslen, &port)) {
+        fprintf(stderr, "-q: bad query endpoint \"%s\" (ADDR:PORT or [ADDR6]:PORT)\n", p_spec_);
+        return false;
+    }
+
+    fd = socket(ss.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        perror("query socket");
+        return false;
+    }
+
+    if (bind(fd, (struct sockaddr *)&ss, sslen)) {
+        fprintf(stderr, "bind query socket %s: %s\n", p_spec_, strerror(errno));
+        close(fd);
+        return false;
+    }
+    *p_fd_ = fd;
+
+    /* signals go to the receive loop, not to us */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    ret = pthread_create(p_thread_, NULL, query_server_main_, p_fd_);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (ret) {
+        fprintf(stderr, "pthread_create() for query: %s\n", strerror(ret));
+        close(fd), *p_fd_ = -1;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+static void cleanup_query_server_(pthread_t thread_, int *p_fd_)
+{
+    assert(p_fd_);
+
+    if (0 <= *p_fd_) {
+        pthread_join(thread_, NULL);
+        close(*p_fd_), *p_fd_ = -1;
+    }
+
+    return;
+}
+#endif /* defined(ENABLE_QUERY_SERVER) */
+
+
+
+/*
+ * Capture
+ *
+ *  Appends every received datagram to a capture file (see hive_capture.h)
+ *  through a sliding mmap window, so recording costs a memcpy per packet
+ *  and a remap every CAPTURE_WINDOW_SIZE bytes.
+ */
+#define CAPTURE_WINDOW_SIZE (16 << 20)
+
+struct capture_writer {
+    int fd;
+    uint8_t *p_map;         /**< current window */
+    off_t map_off;          /**< file offset of window (page aligned) */
+    size_t pos;             /**< write position in window */
+};
+static struct capture_writer g_capture_ = { -1, NULL, 0, 0 };
+
+
+
+/**
+ * Slide the window so that it starts at file offset used_
+ *
+ * Blocks of the window are allocated up front: a store to a page the
+ * file system can't back raises SIGBUS, so running out of disk has to
+ * show up here instead.
+ */
+static bool capture_remap_(struct capture_writer *p_, off_t used_)
+{
+    off_t off = used_ & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    uint8_t *p_map = NULL;
+    int ret = 0;
+
+    if (p_->p_map) {
+        munmap(p_->p_map, CAPTURE_WINDOW_SIZE);
+        p_->p_map = NULL;
+    }
+    ret = posix_fallocate(p_->fd, off, CAPTURE_WINDOW_SIZE);
+    if (ret) {
+        fprintf(stderr, "posix_fallocate() for capture: %s\n", strerror(ret));
+        return false;
+    }
+    p_map = mmap(NULL, CAPTURE_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, p_->fd, off);
+    if (MAP_FAILED == p_map) {
+        perror("mmap() for capture");
+        return false;
+    }
+    p_->p_map   = p_map;
+    p_->map_off = off;
+    p_->pos     = used_ - off;
+
+    return true;
+}
+
+
+
+static bool capture_open_(struct capture_writer *p_, const char *p_path_)
+{
+    struct hive_capture_header hdr;
+
+    assert(p_);
+    assert(p_path_);
+
+    p_->fd = open(p_path_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (p_->fd < 0) {
+        perror(p_path_);
+        return false;
+    }
+    if (!capture_remap_(p_, 0)) {
+        close(p_->fd), p_->fd = -1;
+        return false;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic       = HIVE_CAPTURE_MAGIC;
+    hdr.version     = HIVE_CAPTURE_VERSION;
+    hdr.header_size = sizeof(struct hive_capture_header);
+    hdr.record_size = sizeof(struct hive_capture_record);
+    memcpy(p_->p_map, &hdr, sizeof(hdr));
+    p_->pos = sizeof(hdr);
+
+    return true;
+}
+
+
+
+static void capture_close_(struct capture_writer *p_)
+{
+    off_t used = p_->map_off + p_->pos;
+
+    if (p_->p_map) {
+        munmap(p_->p_map, CAPTURE_WINDOW_SIZE);
+        p_->p_map = NULL;
+    }
+    if (0 <= p_->fd) {
+        if (ftruncate(p_->fd, used)) {
+            perror("ftruncate() for capture");
+        }
+        close(p_->fd), p_->fd = -1;
+    }
+
+    return;
+}
+
+
+
+/** Append datagram received by listener listener_ from *p_ss_ */
+static bool capture_write_(struct capture_writer *p_, uint64_t ts_ns_, unsigned listener_,
+        const struct sockaddr_storage *p_ss_, size_t len_, const uint8_t *p_data_)
+{
+    struct hive_capture_record rec;
+
+    assert(p_);
+    assert(p_ss_);
+    assert(p_data_);
+
+    if (!p_->p_map) {
+        return false;
+    }
+    if (CAPTURE_WINDOW_SIZE - p_->pos < sizeof(rec) + len_ &&
+            !capture_remap_(p_, p_->map_off + p_->pos)) {
+        fprintf(stderr, "capture: stopped at %lld bytes\n",
+                (long long)(p_->map_off + p_->pos));
+        return false;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns      = ts_ns_;
+    rec.len        = len_;
+    rec.listener   = listener_;
+    rec.local_port = htons(g_listeners_[listener_].port);
+    if (AF_INET6 == p_ss_->ss_family) {
+        const struct sockaddr_in6 *p_sa6 = (const struct sockaddr_in6 *)p_ss_;
+
+        rec.family = 6;
+        rec.port   = p_sa6->sin6_port;
+        memcpy(rec.addr, &p_sa6->sin6_addr, 16);
+    } else {
+        const struct sockaddr_in *p_sa = (const struct sockaddr_in *)p_ss_;
+
+        rec.family = 4;
+        rec.port   = p_sa->sin_port;
+        memcpy(rec.addr, &p_sa->sin_addr, 4);
+    }
+
+    memcpy(&p_->p_map[p_->pos], &rec, sizeof(rec));
+    memcpy(&p_->p_map[p_->pos + sizeof(rec)], p_data_, len_);
+    p_->pos += sizeof(rec) + len_;
+
+    return true;
+}
+
+
+
+/*
+ * Batch import
+ *
+ *  Offline replay of a captured datagram file through dispatch_() and the
+ *  delegate plugin's CSV generator, without sockets or wall-clock timing.
+ *
+ *  The file is mmap'ed and split into chunks of BATCH_CHUNK_PACKETS
+ *  datagrams.  Within a chunk each (gateway, device) is assigned to one
+ *  worker thread, so per-device order and dedup state are kept exactly as
+ *  in the live server, and results are merged back in file order.  The
+ *  readings of a batch data packet are indexed one by one, so they are
+ *  assigned by their own device too.
+ *
+ *  Supported files:
+ *      * pcap (tcpdump -w), UDP datagrams toward a listener port over
+ *        Ethernet, Linux cooked (v1/v2), raw IP or BSD loopback.
+ *      * capture file written by -w (see hive_capture.h).
+ *      * raw: UDP packets back to back, framed by their length (B, or the
+ *        16-bit length when B is 0).
+ */
+#define BATCH_CHUNK_PACKETS (1 << 20)
+#define BATCH_MAX_WORKERS   (64)
+#define BATCH_OUT_BUFSIZE   (1 << 20)
+#define BATCH_CRC_GROUP     (32)
+
+#define PCAP_MAGIC_USEC     (0xa1b2c3d4U)
+#define PCAP_MAGIC_NSEC     (0xa1b23c4dU)
+#define PCAP_HEADER_SIZE    (24)
+#define PCAP_RECORD_SIZE    (16)
+
+enum tag_BATCH_FORMATS {
+    BATCH_FORMAT_RAW = 0,
+    BATCH_FORMAT_PCAP,
+    BATCH_FORMAT_CAPTURE
+};
+
+struct batch_packet {
+    const uint8_t *p;       /**< UDP packet (points into the mapping) */
+    uint32_t len;           /**< size of UDP packet in byte */
+    uint16_t sub;           /**< batch data: reading sub - 1 only, CRC checked (0: whole packet) */
+};
+
+struct batch_line {
+    uint32_t idx;           /**< packet index in the chunk */
+    uint32_t off;           /**< offset of CSV string in worker text */
+    uint8_t udp_id;         /**< source UDP client ID */
+};
+
+struct batch_worker {
+    pthread_t thread;
+    const struct batch_packet *p_packets;   /**< chunk (shared) */
+    uint32_t *p_idx;        /**< packets assigned to this worker */
+    size_t nidx;
+    size_t idxcap;
+    uint32_t cur_idx;       /**< packet being handled */
+    struct batch_line *p_lines; /**< CSV lines generated */
+    size_t nlines;
+    size_t linecap;
+    char *p_text;           /**< CSV strings, '\0' terminated each */
+    size_t textlen;
+    size_t textcap;
+    bool failed;            /**< out of memory */
+};
+
+struct batch_reader {
+    const uint8_t *p_begin;
+    const uint8_t *p_cur;
+    const uint8_t *p_end;
+    int format;             /**< BATCH_FORMAT_xxx */
+    bool swapped;           /**< pcap written on the other endianness */
+    uint32_t linktype;      /**< pcap link-layer header type */
+};
+
+
+
+static bool grow_(void **pp_, size_t *p_cap_, size_t need_, size_t elemsize_)
+{
+    size_t cap = *p_cap_ ? *p_cap_ : 1024;
+    void *p = NULL;
+
+    if (need_ <= *p_cap_) {
+        return true;
+    }
+    while (cap < need_) {
+        cap *= 2;
+    }
+    p = realloc(*pp_, cap * elemsize_);
+    if (!p) {
+        return false;
+    }
+    *pp_    = p;
+    *p_cap_ = cap;
+
+    return true;
+}
+
+
+
+static uint32_t pcap_u32_(const struct batch_reader *p_, const uint8_t *p_data_)
+{
+    uint32_t v = 0;
+
+    memcpy(&v, p_data_, sizeof(v));
+
+    return p_->swapped ? __builtin_bswap32(v) : v;
+}
+
+
+
+static bool is_listener_port_(uint16_t port_)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < g_nlisteners_; ++i) {
+        if (g_listeners_[i].port == port_) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+/**
+ * Dig UDP payload toward a listener port out of a captured frame
+ *
+ * \return size of payload, 0 if frame isn't such a datagram
+ */
+static size_t pcap_udp_payload_(uint32_t linktype_, const uint8_t *p_,
+        size_t len_, const uint8_t **pp_payload_)
+{
+    size_t l3 = 0;
+    size_t l4 = 0;
+    size_t ulen = 0;
+
+    switch (linktype_) {
+    case 1:     /* Ethernet */
+        l3 = 14;
+        if (len_ < l3) {
+            return 0;
+        }
+        if (0x8100 == be16_to_uint16_(&p_[12]) || 0x88a8 == be16_to_uint16_(&p_[12])) {
+            l3 += 4;    /* VLAN tag */
+        }
+        break;
+    case 113:   /* Linux cooked v1 */
+        l3 = 16;
+        break;
+    case 276:   /* Linux cooked v2 */
+        l3 = 20;
+        break;
+    case 0:     /* BSD loopback */
+        l3 = 4;
+        break;
+    case 12:    /* raw IP (OpenBSD) */
+    case 101:   /* raw IP */
+        l3 = 0;
+        break;
+    default:
+        return 0;
+    }
+    if (len_ <= l3) {
+        return 0;
+    }
+    p_ += l3, len_ -= l3;
+
+    switch (p_[0] >> 4) {
+    case 4:
+        l4 = (p_[0] & 0x0f) * 4;
+        if (len_ < 20 || l4 < 20 || 17 != p_[9] ||
+                (be16_to_uint16_(&p_[6]) & 0x3fff)) {
+            return 0;   /* not UDP, or a fragment */
+        }
+        break;
+    case 6:
+        l4 = 40;
+        if (len_ < 40 || 17 != p_[6]) {
+            return 0;   /* not UDP (extension headers aren't followed) */
+        }
+        break;
+    default:
+        return 0;
+    }
+    if (len_ < l4 + 8 || !is_listener_port_(be16_to_uint16_(&p_[l4 + 2]))) {
+        return 0;
+    }
+
+    ulen = be16_to_uint16_(&p_[l4 + 4]);
+    if (ulen < 8) {
+        return 0;
+    }
+    ulen -= 8;
+    if (len_ - l4 - 8 < ulen) {
+        ulen = len_ - l4 - 8;   /* snapped */
+    }
+    *pp_payload_ = &p_[l4 + 8];
+
+    return ulen;
+}
+
+
+
+static bool batch_reader_open_(struct batch_reader *p_, const uint8_t *p_data_, size_t size_)
+{
+    uint32_t magic = 0;
+
+    memset(p_, 0, sizeof(*p_));
+    p_->p_begin = p_data_;
+    p_->p_cur   = p_data_;
+    p_->p_end   = p_data_ + size_;
+    p_->format  = BATCH_FORMAT_RAW;
+
+    if (hive_capture_check(p_data_, size_)) {
+        p_->format = BATCH_FORMAT_CAPTURE;
+        p_->p_cur += hive_capture_check(p_data_, size_);
+    } else if (PCAP_HEADER_SIZE <= size_) {
+        memcpy(&magic, p_data_, sizeof(magic));
+        if (PCAP_MAGIC_USEC == magic || PCAP_MAGIC_NSEC == magic) {
+            p_->format = BATCH_FORMAT_PCAP;
+        } else if (PCAP_MAGIC_USEC == __builtin_bswap32(magic) ||
+                PCAP_MAGIC_NSEC == __builtin_bswap32(magic)) {
+            p_->format = BATCH_FORMAT_PCAP;
+            p_->swapped = true;
+        }
+    }
+    if (BATCH_FORMAT_PCAP == p_->format) {
+        p_->linktype = pcap_u32_(p_, &p_data_[20]) & 0xffff;
+        p_->p_cur += PCAP_HEADER_SIZE;
+    }
+
+    return true;
+}
+
+
+
+/**
+ * Fetch next UDP packet from capture
+ *
+ * \retval 1 packet found
+ * \retval 0 end of file
+ * \retval -1 file is broken
+ */
+static int batch_reader_next_(struct batch_reader *p_, struct batch_packet *p_pkt_)
+{
+    while (p_->p_cur < p_->p_end) {
+        size_t rest = p_->p_end - p_->p_cur;
+        const uint8_t *p_frame = NULL;
+        const uint8_t *p_payload = NULL;
+        size_t len = 0;
+
+        if (BATCH_FORMAT_RAW == p_->format) {
+            len = (rest < 2) ? 0 : p_->p_cur[1];
+            if (!len && UDP_EXT_HEADER_SIZE <= rest) {
+                len = be16_to_uint16_(&p_->p_cur[4]);
+            }
+            if (len < UDP_HEADER_SIZE || rest < len) {
+                return -1;
+            }
+            p_pkt_->p   = p_->p_cur;
+            p_pkt_->len = len;
+            p_->p_cur  += len;
+            return 1;
+        }
+
+        if (BATCH_FORMAT_CAPTURE == p_->format) {
+            struct hive_capture_record rec;
+            size_t off = p_->p_cur - p_->p_begin;
+            int ret = hive_capture_next(p_->p_begin, p_->p_end - p_->p_begin,
+                    &off, &rec, &p_payload);
+
+            if (ret <= 0) {
+                return ret;
+            }
+            p_->p_cur   = p_->p_begin + off;
+            p_pkt_->p   = p_payload;
+            p_pkt_->len = rec.len;
+            return 1;
+        }
+
+        /* pcap */
+        if (rest < PCAP_RECORD_SIZE) {
+            return -1;
+        }
+        len = pcap_u32_(p_, &p_->p_cur[8]);
+        if (rest - PCAP_RECORD_SIZE < len) {
+            return -1;
+        }
+        p_frame    = p_->p_cur + PCAP_RECORD_SIZE;
+        p_->p_cur  = p_frame + len;
+        len = pcap_udp_payload_(p_->linktype, p_frame, len, &p_payload);
+        if (len) {
+            p_pkt_->p   = p_payload;
+            p_pkt_->len = len;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/** Batch reading: generate CSV into the worker text */
+static bool batch_reading_(struct reading_ctx *p_ctx_, unsigned udp_id_,
+        const uint8_t *p_lora_)
+{
+    struct batch_worker *p_w = (struct batch_worker *)p_ctx_->p_user;
+    char csv[CSV_BUFSIZE];
+    size_t len = 0;
+
+    {
+        PROF_BEGIN(PROF_STAGE_CSV);
+
+        if (!g_delegate_[udp_id_].p_generate_csv_fn(&g_delegate_[udp_id_],
+                    p_lora_, sizeof(csv), csv)) {
+            fprintf(stderr, "Generate CSV failed\n");
+            return false;
+        }
+        PROF_END(PROF_STAGE_CSV);
+    }
+
+    len = strlen(csv) + 1;
+    if (!grow_((void **)&p_w->p_lines, &p_w->linecap,
+                p_w->nlines + 1, sizeof(*p_w->p_lines)) ||
+            !grow_((void **)&p_w->p_text, &p_w->textcap,
+                p_w->textlen + len, 1)) {
+        p_w->failed = true;
         return false;
     }
-    if (p_udp_[0] != UDP_PROTOCOL_VERSION ||
-            p_udp_[1] != UDP_PACKET_SIZE ||
-            p_udp_[3] != UDP_PKTID_PUSH_DATA) {
-        fprintf(stderr, "Invalid UDP packet format\n");
-        return false;
+    p_w->p_lines[p_w->nlines].idx    = p_w->cur_idx;
+    p_w->p_lines[p_w->nlines].off    = p_w->textlen;
+    p_w->p_lines[p_w->nlines].udp_id = udp_id_;
+    ++p_w->nlines;
+    memcpy(&p_w->p_text[p_w->textlen], csv, len);
+    p_w->textlen += len;
+
+    return true;
+}
+
+
+
+static void *batch_worker_main_(void *p_arg_)
+{
+    struct batch_worker *p_w = (struct batch_worker *)p_arg_;
+    struct reading_ctx ctx;
+    const uint8_t *pp_udp[BATCH_CRC_GROUP];
+    size_t lens[BATCH_CRC_GROUP];
+    size_t crc_lens[BATCH_CRC_GROUP];
+    bool ok[BATCH_CRC_GROUP];
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+
+    prof_attach_("batch");
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.p_reading_fn = batch_reading_;
+    ctx.p_user       = p_w;
+
+    for (i = 0; i < p_w->nidx && !p_w->failed; i += n) {
+        /* check CRC trailers of a group at once */
+        n = MIN_(p_w->nidx - i, BATCH_CRC_GROUP);
+        for (j = 0; j < n; ++j) {
+            const struct batch_packet *p_pkt = &p_w->p_packets[p_w->p_idx[i + j]];
+
+            pp_udp[j]   = p_pkt->p;
+            lens[j]     = p_pkt->len;
+            /* readings of batch data were checked when indexed */
+            crc_lens[j] = p_pkt->sub ? 0 : p_pkt->len;
+        }
+        crc32c_verify_batch_(n, pp_udp, crc_lens, ok);
+
+        for (j = 0; j < n && !p_w->failed; ++j) {
+            if (!ok[j]) {
+                fprintf(stderr, "Invalid UDP packet CRC\n");
+                continue;
+            }
+            p_w->cur_idx = p_w->p_idx[i + j];
+            ctx.flags    = ADMIT_CRC_VERIFIED;
+            ctx.sub      = p_w->p_packets[p_w->cur_idx].sub;
+            dispatch_(lens[j], pp_udp[j], &ctx);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/**
+ * Write out CSV lines of all workers in packet order
+ *
+ * \return number of lines written, or -1 on error
+ */
+static long batch_merge_(struct batch_worker *p_workers_, unsigned nworkers_,
+        FILE *p_out_, bool forward_)
+{
+    size_t pos[BATCH_MAX_WORKERS] = { 0 };
+    long nlines = 0;
+
+    for (;;) {
+        struct batch_worker *p_min = NULL;
+        const struct batch_line *p_line = NULL;
+        const char *p_csv = NULL;
+        unsigned i = 0;
+
+        for (i = 0; i < nworkers_; ++i) {
+            if (pos[i] < p_workers_[i].nlines && (!p_min ||
+                        p_workers_[i].p_lines[pos[i]].idx <
+                        p_min->p_lines[pos[p_min - p_workers_]].idx)) {
+                p_min = &p_workers_[i];
+            }
+        }
+        if (!p_min) {
+            break;
+        }
+        p_line = &p_min->p_lines[pos[p_min - p_workers_]++];
+        p_csv  = &p_min->p_text[p_line->off];
+
+        if (forward_) {
+            if (!g_delegate_[p_line->udp_id].p_send_to_server_fn(
+                        &g_delegate_[p_line->udp_id], p_csv)) {
+                fprintf(stderr, "Send CSV failed\n");
+            }
+        } else if (EOF == fputs(p_csv, p_out_) || EOF == fputc('\n', p_out_)) {
+            perror("batch output");
+            return -1;
+        }
+        ++nlines;
+    }
+
+    return nlines;
+}
+
+
+
+/** Import captured datagrams from p_in_path_ */
+static bool batch_import_(const char *p_in_path_, const char *p_out_path_,
+        bool forward_, unsigned nworkers_)
+{
+    static struct batch_worker workers[BATCH_MAX_WORKERS];
+
+    struct batch_reader reader;
+    struct batch_packet *p_packets = NULL;
+    uint64_t begin_ns = monotonic_ns_();
+    uint64_t npackets = 0;
+    uint64_t nrecords = 0;
+    size_t n = 0;
+    FILE *p_out = stdout;
+    uint8_t *p_map = NULL;
+    struct stat st;
+    bool result = false;
+    int fd = -1;
+    int ret = 0;
+    unsigned i = 0;
+
+    assert(p_in_path_);
+    assert(0 < nworkers_ && nworkers_ <= BATCH_MAX_WORKERS);
+
+    fd = open(p_in_path_, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(p_in_path_);
+        goto out;
+    }
+    if (st.st_size) {
+        p_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED == p_map) {
+            perror("mmap() for batch");
+            p_map = NULL;
+            goto out;
+        }
+        madvise(p_map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    if (!forward_ && p_out_path_ && strcmp(p_out_path_, "-")) {
+        p_out = fopen(p_out_path_, "w");
+        if (!p_out) {
+            perror(p_out_path_);
+            goto out;
+        }
+    }
+    setvbuf(p_out, NULL, _IOFBF, BATCH_OUT_BUFSIZE);
+
+    p_packets = malloc(BATCH_CHUNK_PACKETS * sizeof(*p_packets));
+    if (!p_packets) {
+        perror("malloc() for batch");
+        goto out;
+    }
+    memset(workers, 0, sizeof(workers));
+
+    batch_reader_open_(&reader, p_map, st.st_size);
+    do {
+        long nlines = 0;
+        bool failed = false;
+
+        /* index one chunk, assigning every device to one worker */
+        for (n = 0; n + UDP_BATCH_MAX_READINGS <= BATCH_CHUNK_PACKETS; ) {
+            struct batch_packet pkt;
+            struct udp_frame frame;
+            const char *p_err = NULL;
+            unsigned nsub = 0;
+            unsigned k = 0;
+
+            ret = batch_reader_next_(&reader, &pkt);
+            if (ret <= 0) {
+                break;
+            }
+            ++npackets;
+
+            p_err = udp_frame_parse_(pkt.len, pkt.p, &frame);
+            if (!p_err &&
+                    UDP_PKTID_BATCH_DATA == frame.type &&
+                    frame.data_len == 1 + (size_t)frame.p_data[0] * LORA_PACKET_SIZE) {
+                /* its readings may go to several workers, so check CRC here once */
+                if (UDP_PROTOCOL_VERSION_CRC == pkt.p[0] && !crc32c_verify_(pkt.p, pkt.len)) {
+                    fprintf(stderr, "Invalid UDP packet CRC\n");
+                    continue;
+                }
+                nsub = frame.p_data[0];
+            }
+
+            /* k == 0: whole packet; otherwise reading k - 1 of batch data */
+            for (k = nsub ? 1 : 0; k <= nsub; ++k, ++n) {
+                struct batch_worker *p_w = NULL;
+                unsigned key = 0;
+
+                p_packets[n].p   = pkt.p;
+                p_packets[n].len = pkt.len;
+                p_packets[n].sub = k;
+                if (k) {
+                    key = frame.udp_id * 256U + frame.p_data[1 + (k - 1) * LORA_PACKET_SIZE];
+                } else if (!p_err) {
+                    /* broken packets go to worker 0, which reports them */
+                    key = frame.udp_id * 256U +
+                        ((UDP_PKTID_PUSH_DATA == frame.type) ? frame.p_data[0] : 0);
+                }
+                p_w = &workers[key % nworkers_];
+                if (!grow_((void **)&p_w->p_idx, &p_w->idxcap,
+                            p_w->nidx + 1, sizeof(*p_w->p_idx))) {
+                    perror("realloc() for batch");
+                    goto out;
+                }
+                p_w->p_idx[p_w->nidx++] = n;
+            }
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: broken at offset %ld\n", p_in_path_,
+                    (long)(reader.p_cur - p_map));
+        }
+
+        for (i = 0; i < nworkers_; ++i) {
+            int err = 0;
+
+            workers[i].p_packets = p_packets;
+            err = pthread_create(&workers[i].thread, NULL,
+                    batch_worker_main_, &workers[i]);
+            if (err) {
+                fprintf(stderr, "pthread_create() for batch: %s\n", strerror(err));
+                /* run it here instead */
+                batch_worker_main_(&workers[i]);
+                workers[i].thread = pthread_self();
+            }
+        }
+        for (i = 0; i < nworkers_; ++i) {
+            if (!pthread_equal(workers[i].thread, pthread_self())) {
+                pthread_join(workers[i].thread, NULL);
+            }
+            if (workers[i].failed) {
+                fprintf(stderr, "batch worker %u: out of memory\n", i);
+                failed = true;
+            }
+        }
+        if (failed) {
+            /* all joined, buffers can go */
+            goto out;
+        }
+
+        nlines = batch_merge_(workers, nworkers_, p_out, forward_);
+        if (nlines < 0) {
+            goto out;
+        }
+        nrecords += nlines;
+
+        for (i = 0; i < nworkers_; ++i) {
+            workers[i].nidx    = 0;
+            workers[i].nlines  = 0;
+            workers[i].textlen = 0;
+        }
+
+        /* between chunks no worker runs, so the tables hold still */
+        if (g_do_prof_dump_) {
+            g_do_prof_dump_ = 0;
+            prof_dump_();
+        }
+    } while (0 < ret && !g_do_term_);
+
+    if (EOF == fflush(p_out)) {
+        perror("batch output");
+        goto out;
+    }
+    result = true;
+
+    fprintf(stderr, "batch: %lu packets, %lu records, %.3lf sec, %u workers\n",
+            (unsigned long)npackets, (unsigned long)nrecords,
+            (double)(monotonic_ns_() - begin_ns) / 1000000000, nworkers_);
+
+out:
+    for (i = 0; i < BATCH_MAX_WORKERS; ++i) {
+        free(workers[i].p_idx);
+        free(workers[i].p_lines);
+        free(workers[i].p_text);
+    }
+    memset(workers, 0, sizeof(workers));
+    free(p_packets);
+    if (p_out && p_out != stdout) {
+        fclose(p_out);
+    }
+    if (p_map) {
+        munmap(p_map, st.st_size);
+    }
+    if (0 <= fd) {
+        close(fd);
+    }
+
+    return result;
+}
+
+
+
+#define RX_CRC_GROUP (32)   /**< datagrams per crc32c_verify_batch_() */
+#define RX_CTRL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + \
+        CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int)))
+
+/** Kernel receive queue drops, from SO_RXQ_OVFL */
+struct rx_drops {
+    uint32_t counter;       /**< last counter seen (socket lifetime, wraps) */
+    uint32_t reported;      /**< counter at last report */
+    uint64_t total;         /**< drops reported so far */
+};
+
+/** Received datagrams waiting for their CRC check, in arrival order */
+struct rx_group {
+    size_t n;
+    const uint8_t *pp_udp[RX_CRC_GROUP];
+    size_t lens[RX_CRC_GROUP];
+    uint64_t rx_ns[RX_CRC_GROUP];
+    const struct sockaddr_storage *p_names[RX_CRC_GROUP];
+    bool ok[RX_CRC_GROUP];
+    unsigned listener;      /**< index in g_listeners_ of the socket */
+};
+
+/** Receive buffers of one socket, filled by one recvmmsg() */
+struct rx_pool {
+    struct mmsghdr msgs[UDP_RX_BATCH];
+    struct iovec iovs[UDP_RX_BATCH];
+    struct sockaddr_storage names[UDP_RX_BATCH];
+    union {
+        struct cmsghdr align;
+        uint8_t buf[RX_CTRL_SIZE];
+    } ctrls[UDP_RX_BATCH];
+    uint8_t bufs[UDP_RX_BATCH][UDP_RX_SLOTSIZE];
+    struct rx_group group;  /**< datagrams of the batch, see rx_group_flush_() */
+    uint64_t truncated;     /**< datagrams larger than a buffer, dropped */
+    struct rx_drops drops;  /**< kernel drops of the socket */
+};
+
+
+
+static void rx_pool_init_(struct rx_pool *p_)
+{
+    unsigned i = 0;
+
+    memset(p_, 0, sizeof(*p_));
+    for (i = 0; i < UDP_RX_BATCH; ++i) {
+        p_->iovs[i].iov_base = p_->bufs[i];
+        p_->iovs[i].iov_len  = UDP_RX_SLOTSIZE;
+        p_->msgs[i].msg_hdr.msg_iov    = &p_->iovs[i];
+        p_->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return;
+}
+
+
+
+/**
+ * Check CRC of the pending datagrams at once and hand them to delegate_()
+ *
+ * Same-length packets are checked four at a time (see
+ * crc32c_verify_batch_()).  Ones that fail go through delegate_()
+ * unverified, which reports and drops them.
+ */
+static void rx_group_flush_(struct rx_group *p_)
+{
+    size_t i = 0;
+
+    if (!p_->n) {
+        return;
+    }
+
+    {
+        PROF_BEGIN(PROF_STAGE_VALIDATE);
+
+        crc32c_verify_batch_(p_->n, p_->pp_udp, p_->lens, p_->ok);
+        PROF_END(PROF_STAGE_VALIDATE);
+    }
+
+    for (i = 0; i < p_->n; ++i) {
+        if (g_capture_.p_map) {
+            capture_write_(&g_capture_, p_->rx_ns[i], p_->listener,
+                    p_->p_names[i], p_->lens[i], p_->pp_udp[i]);
+        }
+
+#if defined(ENABLE_DEBUG)
+        fprintf(stderr, "call delegate_()\n");
+#endif /* defined(ENABLE_DEBUG) */
+        if (delegate_(p_->lens[i], p_->pp_udp[i],
+                    p_->ok[i] ? ADMIT_CRC_VERIFIED : 0)) {
+            uint64_t now = realtime_ns_();
+
+            log_hist_add_(&g_latency_hist_,
+                    (p_->rx_ns[i] < now) ? now - p_->rx_ns[i] : 0);
+        }
+    }
+    p_->n = 0;
+
+    return;
+}
+
+
+
+/**
+ * Queue one received buffer for delegate_()
+ *
+ * With UDP_GRO the kernel may hand over a burst of same-flow datagrams in
+ * one buffer; it is split by the segment size and each datagram is
+ * handled as if received alone.
+ */
+static void receive_msg_(struct rx_pool *p_pool_, struct msghdr *p_msg_,
+        size_t len_, const uint8_t *p_buf_)
+{
+    struct cmsghdr *p_cmsg = NULL;
+    uint64_t rx_ns = 0;
+    size_t seg_size = 0;
+    size_t off = 0;
+
+    for (p_cmsg = CMSG_FIRSTHDR(p_msg_); p_cmsg; p_cmsg = CMSG_NXTHDR(p_msg_, p_cmsg)) {
+        if (SOL_SOCKET == p_cmsg->cmsg_level && SCM_TIMESTAMPNS == p_cmsg->cmsg_type) {
+            struct timespec ts;
+
+            memcpy(&ts, CMSG_DATA(p_cmsg), sizeof(ts));
+            rx_ns = (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+        } else if (SOL_SOCKET == p_cmsg->cmsg_level && SO_RXQ_OVFL == p_cmsg->cmsg_type) {
+            memcpy(&p_pool_->drops.counter, CMSG_DATA(p_cmsg), sizeof(uint32_t));
+        } else if (SOL_UDP == p_cmsg->cmsg_level && UDP_GRO == p_cmsg->cmsg_type) {
+            int gso_size = 0;
+
+            memcpy(&gso_size, CMSG_DATA(p_cmsg), sizeof(gso_size));
+            seg_size = (0 < gso_size) ? (size_t)gso_size : 0;
+        }
+    }
+    if (!rx_ns) {
+        rx_ns = realtime_ns_();
+    }
+    if (!seg_size) {
+        seg_size = len_;
+    }
+
+    /* every segment but the last is seg_size long */
+    for (off = 0; off < len_; off += seg_size) {
+        struct rx_group *p_group = &p_pool_->group;
+
+        if (RX_CRC_GROUP == p_group->n) {
+            rx_group_flush_(p_group);
+        }
+        p_group->pp_udp[p_group->n]  = &p_buf_[off];
+        p_group->lens[p_group->n]    = MIN_(len_ - off, seg_size);
+        p_group->rx_ns[p_group->n]   = rx_ns;
+        p_group->p_names[p_group->n] = p_msg_->msg_name;
+        ++p_group->n;
+    }
+
+    return;
+}
+
+
+
+/**
+ * Receive up to UDP_RX_BATCH datagrams and hand them to delegate_()
+ *
+ * CRC trailers of the whole batch are checked together before any of
+ * them is handled (see rx_group_flush_()).  Asks the kernel for the arrival timestamp, which feeds capture and the
+ * receive-to-forward latency histogram.  Datagrams are variable length;
+ * MSG_TRUNC makes the kernel report the real length, so one too large
+ * for a pool buffer is detected (and dropped) without reading it twice.
+ *
+ * \return as recvmmsg()
+ */
+static int receive_batch_(int socket_fd_, struct rx_pool *p_pool_)
+{
+    int nr = -1;
+    int i = 0;
+    PROF_BEGIN(PROF_STAGE_RECV);
+
+    for (i = 0; i < UDP_RX_BATCH; ++i) {
+        struct msghdr *p_msg = &p_pool_->msgs[i].msg_hdr;
+
+        p_msg->msg_name       = &p_pool_->names[i];
+        p_msg->msg_namelen    = sizeof(p_pool_->names[i]);
+        p_msg->msg_control    = p_pool_->ctrls[i].buf;
+        p_msg->msg_controllen = sizeof(p_pool_->ctrls[i].buf);
+        p_msg->msg_flags      = 0;
+    }
+
+    nr = recvmmsg(socket_fd_, p_pool_->msgs, UDP_RX_BATCH, MSG_TRUNC, NULL);
+    if (nr <= 0) {
+        return nr;
+    }
+    PROF_END(PROF_STAGE_RECV);
+
+    for (i = 0; i < nr; ++i) {
+        struct msghdr *p_msg = &p_pool_->msgs[i].msg_hdr;
+        const size_t len = p_pool_->msgs[i].msg_len;
+
+        if (UDP_RX_SLOTSIZE < len || (p_msg->msg_flags & MSG_TRUNC)) {
+            fprintf(stderr, "recv: %lu bytes datagram truncated, dropped\n",
+                    (unsigned long)len);
+            ++p_pool_->truncated;
+            continue;
+        }
+        if (!len) {
+            fprintf(stderr, "recv: 0 byte packet received\n");
+            continue;
+        }
+        receive_msg_(p_pool_, p_msg, len, p_pool_->bufs[i]);
+    }
+    rx_group_flush_(&p_pool_->group);
+
+    return nr;
+}
+
+
+
+/** Print kernel receive queue drops of a listener seen since the last call */
+static void report_rx_drops_(const struct listener *p_l_)
+{
+    struct rx_drops *p_drops = &p_l_->p_pool->drops;
+    const uint32_t n = p_drops->counter - p_drops->reported;
+
+    if (n) {
+        fprintf(stderr, "recv %s: kernel dropped %u datagrams (receive queue full)\n",
+                p_l_->spec, n);
+        p_drops->reported = p_drops->counter;
+        p_drops->total   += n;
+    }
+
+    return;
+}
+
+
+
+/**
+ * Set up receive side options of the server socket
+ *
+ * Kernel timestamps, a large receive buffer (SO_RCVBUFFORCE if permitted,
+ * SO_RCVBUF up to net.core.rmem_max otherwise), drop counter and, if
+ * enabled, UDP_GRO.  Failures only cost features, so they're not fatal.
+ */
+static void setup_rx_socket_(int socket_fd_, int rcvbuf_)
+{
+    const int on = 1;
+    int got = 0;
+    socklen_t optlen = sizeof(got);
+
+    /* kernel arrival time, for capture and latency */
+    if (setsockopt(socket_fd_, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on))) {
+        perror("setsockopt(SO_TIMESTAMPNS)");
+    }
+
+    if (0 < rcvbuf_) {
+        if (setsockopt(socket_fd_, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf_, sizeof(rcvbuf_)) &&
+                setsockopt(socket_fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf_, sizeof(rcvbuf_))) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        /* the kernel reports twice the size (bookkeeping overhead included) */
+        if (!getsockopt(socket_fd_, SOL_SOCKET, SO_RCVBUF, &got, &optlen) &&
+                got / 2 < rcvbuf_) {
+            fprintf(stderr, "SO_RCVBUF: %d bytes (requested %d), "
+                    "raise net.core.rmem_max or run with CAP_NET_ADMIN\n",
+                    got / 2, rcvbuf_);
+        }
+    }
+
+    if (setsockopt(socket_fd_, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on))) {
+        perror("setsockopt(SO_RXQ_OVFL), kernel drops not reported");
+    }
+
+#if defined(ENABLE_UDP_GRO)
+    if (setsockopt(socket_fd_, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+        perror("setsockopt(UDP_GRO), datagrams received one by one");
     }
+#endif /* defined(ENABLE_UDP_GRO) */
+
+    return;
+}
+
 
-    udp_id = p_udp_[2];
-    if (MAX_UDP_CLIENT_IDS <= udp_id) {
-        fprintf(stderr, "Invalid UDP client ID: %u\n", udp_id);
+
+/**
+ * Add a listener from "ADDR:PORT" or "[ADDR6]:PORT"
+ *
+ * ADDR "*" (or empty) is any IPv4 address, "[::]" any IPv6 address.
+ */
+static bool listener_add_(const char *p_spec_)
+{
+    struct listener *p_l = NULL;
+
+    assert(p_spec_);
+
+    if (MAX_LISTENERS <= g_nlisteners_) {
+        fprintf(stderr, "-l: %d listeners at most\n", MAX_LISTENERS);
         return false;
     }
 
-    /*
-     * LoRa data format:
-     *
-     *  All multi-byte fields are big endian.
-     *
-     *  |<------------------------ 43 bytes -------------------------->|
-     *  |<- 3 bytes ->|<---------------- 40 bytes -------------------->|
-     *  +----+---+----+------+------+-----+--------+------+-------+----+
-     *  | ID | N | PI | DATE | TIME | GPS | TEMPx4 | RHx4 | VOLx4 | WT |
-     *  +----+---+----+------+------+-----+--------+------+-------+----+
-     *
-     *      * Header (3 bytes)
-     *          * ID (1 byte) : Device ID
-     *          * N (1 byte) : Packet serial number
-     *          * PI (1 byte) : Reserved (always 1)
-     *      * Payload (40 bytes)
-     *          * DATE (3 bytes) year, month, day
-     *          * TIME (3 bytes) hour, minute, second
-     *          * GPS (8 bytes) lat-N (4 bytes), lon-E (4 bytes)
-     *          * TEMPx4 (8 bytes) temperature (each 2 bytes) x 4
-     *          * RHx4 (8 bytes) RH. (each 2 bytes) x 4
-     *          * VOLx4 (8 bytes) volume (each 2 bytes) x 4
-     *          * WT (2 bytes) weight
-     */
-    p_lora = &p_udp_[4];
-    lora_id = p_lora[0];
-    if (MAX_LORA_CLIENTS <= lora_id) {
-        fprintf(stderr, "Invalid LoRa client ID: %u\n", lora_id);
+    p_l = &g_listeners_[g_nlisteners_];
+    memset(p_l, 0, sizeof(*p_l));
+    p_l->fd = -1;
+    if (sizeof(p_l->spec) <= strlen(p_spec_) ||
+            !parse_endpoint_(p_spec_, &p_l->ss, &p_l->sslen, &p_l->port)) {
+        fprintf(stderr, "-l: bad listener \"%s\" (ADDR:PORT or [ADDR6]:PORT)\n", p_spec_);
         return false;
     }
+    strcpy(p_l->spec, p_spec_);
+    ++g_nlisteners_;
 
-    p_hist = g_lora_histories_[udp_id][lora_id];
-    if (!memcmp(p_hist, p_lora, LORA_PACKET_SIZE)) {
-#if defined(ENABLE_DEBUG)
-        fprintf(stderr, "same data exists\n");
-#endif /* defined(ENABLE_DEBUG) */
-        return true;
+    return true;
+}
+
+
+
+static void close_listener_(struct listener *p_l_)
+{
+    if (0 <= p_l_->fd) {
+        close(p_l_->fd);
+        p_l_->fd = -1;
     }
+    free(p_l_->p_pool);
+    p_l_->p_pool = NULL;
+
+    return;
+}
+
 
-    /* new data arrival */
-#if defined(ENABLE_DEBUG)
-    fprintf(stderr, "new data arrival\n");
-#endif /* defined(ENABLE_DEBUG) */
-    memcpy(p_hist, p_lora, LORA_PACKET_SIZE);
 
-    assert(g_delegate_[udp_id].p_generate_csv_fn);
-    if (!g_delegate_[udp_id].p_generate_csv_fn(&g_delegate_[udp_id],
-                p_lora, sizeof(csv), csv)) {
-        fprintf(stderr, "Generate CSV failed\n");
+/** Create, bind and set up the socket of a listener */
+static bool open_listener_(struct listener *p_l_, int rcvbuf_)
+{
+    int ret = 0;
+
+    assert(p_l_);
+    assert(p_l_->fd < 0);
+
+    p_l_->p_pool = malloc(sizeof(*p_l_->p_pool));
+    if (!p_l_->p_pool) {
+        perror("malloc() for rx pool");
+        return false;
+    }
+    rx_pool_init_(p_l_->p_pool);
+    p_l_->p_pool->group.listener = p_l_ - g_listeners_;
+
+    p_l_->fd = socket(p_l_->ss.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (p_l_->fd < 0) {
+        perror("server socket");
+        close_listener_(p_l_);
         return false;
     }
 
-    assert(g_delegate_[udp_id].p_send_to_server_fn);
-    if (!g_delegate_[udp_id].p_send_to_server_fn(&g_delegate_[udp_id], csv)) {
-        fprintf(stderr, "Send CSV failed\n");
+    if (AF_INET6 == p_l_->ss.ss_family) {
+        /* leave IPv4 of the same port to its own listener */
+        int on = 1;
+
+        if (setsockopt(p_l_->fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on))) {
+            perror("setsockopt(IPV6_V6ONLY)");
+        }
+    }
+
+    /* we don't want to use recvfrom(), so treat bind() here */
+    if (bind(p_l_->fd, (struct sockaddr *)&p_l_->ss, p_l_->sslen)) {
+        fprintf(stderr, "bind %s: %s\n", p_l_->spec, strerror(errno));
+        close_listener_(p_l_);
         return false;
     }
 
+#if defined(ENABLE_POSIX_NONBLOCK)
+    {   /* POSIX style */
+        int flags = fcntl(p_l_->fd, F_GETFL, 0);
+
+        flags |= O_NONBLOCK;
+        ret = fcntl(p_l_->fd, F_SETFL, flags);
+        if (ret) {
+            perror("fcntl(O_NONBLOCK)");
+            close_listener_(p_l_);
+            return false;
+        }
+    }
+#else /* defined(ENABLE_POSIX_NONBLOCK) */
+    {   /* old style */
+        int blk = 1;
+
+        ret = ioctl(p_l_->fd, FIONBIO, &blk);
+        if (ret) {
+            perror("ioctl(FIONBIO)");
+            close_listener_(p_l_);
+            return false;
+        }
+    }
+#endif /* defined(ENABLE_POSIX_NONBLOCK) */
+
+    setup_rx_socket_(p_l_->fd, rcvbuf_);
+
     return true;
 }
 
 
 
-static void cleanup_delegate_(void)
+/**
+ * Low-latency receive loop
+ *
+ * Polls the non-blocking socket without sleeping; after BUSY_SPIN_COUNT
+ * empty polls it yields the CPU, and after BUSY_YIELD_COUNT more it falls
+ * back to sleeping in select() until traffic resumes.
+ */
+static void busy_poll_loop_(void)
 {
-    int i = 0;
+    unsigned idle = 0;
 
-    for (i = 0; i < MAX_UDP_CLIENT_IDS; ++i) {
-        if (g_delegate_[i].p_deinit_fn) {
-            g_delegate_[i].p_deinit_fn(i, &g_delegate_[i]);
+    for ( ; !g_do_term_; ) {
+        bool got = false;
+        unsigned i = 0;
+
+        if (g_do_prof_dump_) {
+            g_do_prof_dump_ = 0;
+            prof_dump_();
+        }
+
+        for (i = 0; i < g_nlisteners_; ++i) {
+            struct listener *p_l = &g_listeners_[i];
+            int nr = receive_batch_(p_l->fd, p_l->p_pool);
+
+            if (0 <= nr) {
+                got = true;
+            } else if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+                perror("recvmmsg");
+                g_do_term_ = 1;
+                break;
+            }
+        }
+        if (got) {
+            idle = 0;
+            continue;
+        }
+        if (g_do_term_) {
+            break;
+        }
+
+        /* all queues drained: end of a wakeup */
+        if (!idle) {
+            for (i = 0; i < g_nlisteners_; ++i) {
+                report_rx_drops_(&g_listeners_[i]);
+            }
+        }
+        ++idle;
+        if (idle < BUSY_SPIN_COUNT) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            __asm__ __volatile__("yield");
+#endif /* defined(__x86_64__) || defined(__i386__) */
+        } else if (idle < BUSY_SPIN_COUNT + BUSY_YIELD_COUNT) {
+            sched_yield();
+        } else {
+            fd_set rfds;
+            struct timeval tv;
+            int nfds = -1;
+
+            FD_ZERO(&rfds);
+            for (i = 0; i < g_nlisteners_; ++i) {
+                FD_SET(g_listeners_[i].fd, &rfds);
+                nfds = MAX_(nfds, g_listeners_[i].fd);
+            }
+            tv.tv_sec  = UDP_SERVER_TIMEOUT_SEC;
+            tv.tv_usec = UDP_SERVER_TIMEOUT_USEC;
+            select(nfds + 1, &rfds, NULL, NULL, &tv);
+            idle = 0;
         }
     }
 
@@ -464,49 +4179,107 @@ static void cleanup_delegate_(void)
 
 
 
-static bool setup_delegate_(void)
+/** Pin calling thread to one CPU */
+static void pin_cpu_(int cpu_)
 {
-    unsigned i = 0;
+    cpu_set_t set;
+    int ret = 0;
 
-    memset(g_delegate_, 0, sizeof(g_delegate_));
+    CPU_ZERO(&set);
+    CPU_SET(cpu_, &set);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret) {
+        fprintf(stderr, "pthread_setaffinity_np(%d): %s, receive loop not pinned\n",
+                cpu_, strerror(ret));
+    }
 
-    for (i = 0; i < MAX_UDP_CLIENT_IDS; ++i) {
-        switch (i) {
-        case UDP_CLIENT_ID_DUMMY:
-#if defined(ENABLE_DEBUG)
-            fprintf(stderr, "dummy device id %u, skipped\n", i);
-#endif /* defined(ENABLE_DEBUG) */
-            break;
+    return;
+}
 
-        case UDP_CLIENT_ID_MAIN:
-            g_delegate_[i].p_init_fn           = init_mike_;
-            g_delegate_[i].p_deinit_fn         = deinit_mike_;
-            g_delegate_[i].p_generate_csv_fn   = generate_csv_mike_;
-            g_delegate_[i].p_send_to_server_fn = send_to_server_mike_;
-            if (!g_delegate_[i].p_init_fn(i, &g_delegate_[i])) {
-                cleanup_delegate_();
-                return false;
-            }
-            break;
 
-        default:
-#if defined(ENABLE_DEBUG)
-            fprintf(stderr, "unknown device id %u, skipped\n", i);
-#endif /* defined(ENABLE_DEBUG) */
-            break;
+
+/** Turn the process into low-latency mode (see busy_poll_loop_()) */
+static void setup_low_latency_(int cpu_)
+{
+    int usec = BUSY_POLL_USEC;
+    unsigned i = 0;
+
+    for (i = 0; i < g_nlisteners_; ++i) {
+        if (setsockopt(g_listeners_[i].fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec))) {
+            perror("setsockopt(SO_BUSY_POLL), spinning in user space only");
         }
     }
 
-    return true;
+    if (0 <= cpu_) {
+        pin_cpu_(cpu_);
+    }
+
+    /* fault in and pin everything mapped so far (buffers, history, ...) */
+    if (mlockall(MCL_CURRENT)) {
+        perror("mlockall, pages stay pageable");
+    }
+
+    return;
+}
+
+
+
+static void report_latency_(const char *p_mode_)
+{
+    const struct log_hist *p_hist = &g_latency_hist_;
+
+    if (!p_hist->total) {
+        return;
+    }
+    fprintf(stderr, "latency [%s]: n=%lu p50=%.1lfus p99=%.1lfus p99.9=%.1lfus max=%.1lfus\n"
+            , p_mode_, (unsigned long)p_hist->total
+            , (double)log_hist_quantile_(p_hist, 0.50) / 1000
+            , (double)log_hist_quantile_(p_hist, 0.99) / 1000
+            , (double)log_hist_quantile_(p_hist, 0.999) / 1000
+            , (double)p_hist->max / 1000);
+
+    return;
 }
 
 
 
-int main(void)
+static void usage_(const char *p_prog_)
 {
-    static uint8_t buf[UDP_BUFSIZE];
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -l ADDR:PORT | [ADDR6]:PORT\n"
+            "            listen on it (repeatable, default: %s:%d)\n"
+            "  -q ADDR:PORT | [ADDR6]:PORT\n"
+            "            answer latest-value queries on it (default: %s:%d)\n"
+            "  -w FILE   capture received datagrams to FILE\n"
+            "  -L        low-latency mode (busy poll, mlock)\n"
+            "  -C CPU    pin the receive loop to CPU\n"
+            "  -b BYTES  socket receive buffer size (default: %d)\n"
+            "  -S DIR    store readings in column store DIR (e.g. %s)\n"
+            "  -R        publish readings to shared memory ring %s\n"
+            "  -r PPS[:BURST]\n"
+            "            per gateway packet rate limit (default: %d:%d, 0: off)\n"
+            "  -d PPS[:BURST]\n"
+            "            per device packet rate limit (default: %d:%d, 0: off)\n"
+            "  -i FILE   batch import captured datagrams (-w, pcap or raw) and exit\n"
+            "  -o FILE   batch output CSV file (default: stdout)\n"
+            "  -f        batch output goes to the forwarding server instead\n"
+            "  -j N      batch worker threads (default: online CPUs)\n"
+            "  -h        show this help\n"
+            , p_prog_, UDP_SERVER_ADDR, UDP_SERVER_PORT
+            , QUERY_SERVER_ADDR, QUERY_SERVER_PORT
+            , UDP_RCVBUF_SIZE, HIVE_STORE_DIR, SHM_RING_NAME
+            , RATE_LIMIT_GATEWAY_PPS, RATE_LIMIT_GATEWAY_BURST
+            , RATE_LIMIT_DEVICE_PPS, RATE_LIMIT_DEVICE_BURST);
+
+    return;
+}
+
 
-    int socket_fd = -1;
+
+int main(int argc, char *argv[])
+{
+    unsigned i = 0;
 
     int nfds = -1;
     fd_set rfds_init;
@@ -516,132 +4289,316 @@ int main(void)
 
     int ret = -1;
 
+#if defined(ENABLE_QUERY_SERVER)
+    char query_spec[sizeof(g_listeners_[0].spec)] = "";
+    pthread_t query_thread;
+    int query_fd = -1;
+#endif /* defined(ENABLE_QUERY_SERVER) */
+
+    const char *p_capture = NULL;
+    bool low_latency = false;
+    int cpu = -1;
+    long rcvbuf = UDP_RCVBUF_SIZE;
+    const char *p_batch_in = NULL;
+    const char *p_batch_out = NULL;
+    bool batch_forward = false;
+    long batch_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+
+
+    while (-1 != (ret = getopt(argc, argv, "l:q:w:LC:b:S:Rr:d:i:o:fj:h"))) {
+        switch (ret) {
+        case 'l':
+            if (!listener_add_(optarg)) {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+#if defined(ENABLE_QUERY_SERVER)
+            if (sizeof(query_spec) <= strlen(optarg)) {
+                fprintf(stderr, "-q: bad query endpoint \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            strcpy(query_spec, optarg);
+#endif /* defined(ENABLE_QUERY_SERVER) */
+            break;
+        case 'w':
+            p_capture = optarg;
+            break;
+        case 'L':
+            low_latency = true;
+            break;
+        case 'C':
+            cpu = strtol(optarg, NULL, 0);
+            if (cpu < 0 || CPU_SETSIZE <= cpu) {
+                fprintf(stderr, "-C: 0..%d\n", CPU_SETSIZE - 1);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            rcvbuf = strtol(optarg, NULL, 0);
+            if (rcvbuf < 0 || INT_MAX / 2 < rcvbuf) {
+                fprintf(stderr, "-b: 0..%d (0: system default)\n", INT_MAX / 2);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+#if defined(ENABLE_SHM_RING)
+            g_shm_ring_info.p_name = SHM_RING_NAME;
+#endif /* defined(ENABLE_SHM_RING) */
+            break;
+        case 'r':
+            if (!rate_limit_parse_(optarg, &g_gateway_limit_)) {
+                fprintf(stderr, "-r: PPS[:BURST] (PPS 0: off)\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            if (!rate_limit_parse_(optarg, &g_device_limit_)) {
+                fprintf(stderr, "-d: PPS[:BURST] (PPS 0: off)\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+#if defined(ENABLE_COLUMN_STORE)
+            g_column_store_info.p_dir = optarg;
+#endif /* defined(ENABLE_COLUMN_STORE) */
+            break;
+        case 'i':
+            p_batch_in = optarg;
+            break;
+        case 'o':
+            p_batch_out = optarg;
+            break;
+        case 'f':
+            batch_forward = true;
+            break;
+        case 'j':
+            batch_workers = strtol(optarg, NULL, 0);
+            if (batch_workers <= 0 || BATCH_MAX_WORKERS < batch_workers) {
+                fprintf(stderr, "-j: 1..%d\n", BATCH_MAX_WORKERS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage_(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage_(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (0 <= cpu) {
+        cpu_set_t allowed;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) || !CPU_ISSET(cpu, &allowed)) {
+            fprintf(stderr, "-C: CPU %d is not available to this process\n", cpu);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!g_nlisteners_) {
+        char spec[sizeof(g_listeners_[0].spec)];
 
+        snprintf(spec, sizeof(spec), "%s:%d", UDP_SERVER_ADDR, UDP_SERVER_PORT);
+        listener_add_(spec);
+    }
+#if defined(ENABLE_QUERY_SERVER)
+    if (!query_spec[0]) {
+        snprintf(query_spec, sizeof(query_spec), "%s:%d",
+                QUERY_SERVER_ADDR, QUERY_SERVER_PORT);
+    }
+#endif /* defined(ENABLE_QUERY_SERVER) */
+    if (batch_workers <= 0) {
+        batch_workers = 1;
+    } else if (BATCH_MAX_WORKERS < batch_workers) {
+        batch_workers = BATCH_MAX_WORKERS;
+    }
 
 #if defined(ENABLE_DEBUG)
     fprintf(stderr, "BEGIN\n");
 #endif /* defined(ENABLE_DEBUG) */
 
     g_do_term_ = 0;
+    crc32c_setup_();
     memset(g_lora_histories_, 0, sizeof(g_lora_histories_));
+    memset(g_lora_dedups_, 0, sizeof(g_lora_dedups_));
+    memset(g_device_buckets_, 0, sizeof(g_device_buckets_));
+    memset(g_gateway_buckets_, 0, sizeof(g_gateway_buckets_));
+    memset(g_gateway_heartbeats_, 0, sizeof(g_gateway_heartbeats_));
     if (!setup_delegate_()) {
         fprintf(stderr, "Fatal error: setup_delegate_()\n");
         return EXIT_FAILURE;
     }
 
-    signal(SIGINT, sig_handler);
+#if defined(ENABLE_STAGE_PROFILE)
+    signal(SIGUSR1, sig_handler_usr1);
+#endif /* defined(ENABLE_STAGE_PROFILE) */
+
+    if (p_batch_in) {
+        signal(SIGINT, sig_handler);
+        ret = batch_import_(p_batch_in, p_batch_out, batch_forward, batch_workers);
+        prof_dump_();
+        prof_cleanup_();
+        cleanup_delegate_();
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    socket_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (socket_fd < 0) {
-        perror("server socket");
+    if (!setup_sinks_()) {
+        fprintf(stderr, "Fatal error: setup_sinks_()\n");
+        cleanup_delegate_();
         return EXIT_FAILURE;
     }
 
-    /* we don't want to use recvfrom(), so treat bind() here */
-    {
-        struct sockaddr_in sa;
-
-        sa.sin_family      = AF_INET;
-        sa.sin_port        = htons(UDP_SERVER_PORT);
-        /* sa.sin_addr.s_addr = INADDR_ANY; */
-        if (1 != inet_pton(AF_INET, UDP_SERVER_ADDR, &sa.sin_addr.s_addr) ||
-                bind(socket_fd, (struct sockaddr *)&sa, sizeof(sa))) {
-            perror("bind");
-            close(socket_fd), socket_fd = -1;
-            return EXIT_FAILURE;
-        }
+    if (p_capture && !capture_open_(&g_capture_, p_capture)) {
+        fprintf(stderr, "Fatal error: capture_open_()\n");
+        cleanup_sinks_();
+        cleanup_delegate_();
+        return EXIT_FAILURE;
     }
 
-#if defined(ENABLE_POSIX_NONBLOCK)
-    {   /* POSIX style */
-        int flags = fcntl(socket_fd, F_GETFL, 0);
+    signal(SIGINT, sig_handler);
+    prof_attach_("receive");
 
-        flags |= O_NONBLOCK;
-        ret = fcntl(socket_fd, F_SETFL, flags);
-        if (ret) {
-            perror("fcntl(O_NONBLOCK)");
-            close(socket_fd), socket_fd = -1;
-            return EXIT_FAILURE;
-        }
+#if defined(ENABLE_QUERY_SERVER)
+    if (!setup_query_server_(query_spec, &query_thread, &query_fd)) {
+        fprintf(stderr, "Fatal error: setup_query_server_()\n");
+        cleanup_sinks_();
+        cleanup_delegate_();
+        return EXIT_FAILURE;
     }
-#else /* defined(ENABLE_POSIX_NONBLOCK) */
-    {   /* old style */
-        int blk = 1;
+#endif /* defined(ENABLE_QUERY_SERVER) */
 
-        ret = ioctl(socket_fd, FIONBIO, &blk);
-        if (ret) {
-            perror("ioctl(FIONBIO)");
-            close(socket_fd), socket_fd = -1;
+    nfds = -1;
+    FD_ZERO(&rfds_init);
+    for (i = 0; i < g_nlisteners_; ++i) {
+        if (!open_listener_(&g_listeners_[i], rcvbuf)) {
+            fprintf(stderr, "Fatal error: open_listener_(%s)\n", g_listeners_[i].spec);
+            while (i--) {
+                close_listener_(&g_listeners_[i]);
+            }
+#if defined(ENABLE_QUERY_SERVER)
+            g_do_term_ = 1;
+            cleanup_query_server_(query_thread, &query_fd);
+#endif /* defined(ENABLE_QUERY_SERVER) */
+            capture_close_(&g_capture_);
+            cleanup_sinks_();
+            cleanup_delegate_();
             return EXIT_FAILURE;
         }
+        FD_SET(g_listeners_[i].fd, &rfds_init);
+        nfds = MAX_(nfds, g_listeners_[i].fd);
     }
-#endif /* defined(ENABLE_POSIX_NONBLOCK) */
-
-    nfds = -1;
-    FD_ZERO(&rfds_init);
-    FD_SET(socket_fd, &rfds_init);
-    nfds = MAX_(nfds, socket_fd);
     ++nfds;
 
     timeout_init.tv_sec  = UDP_SERVER_TIMEOUT_SEC;
     timeout_init.tv_usec = UDP_SERVER_TIMEOUT_USEC;
 
+    memset(&g_latency_hist_, 0, sizeof(g_latency_hist_));
+    if (low_latency) {
+        setup_low_latency_(cpu);
+        busy_poll_loop_();
+    } else if (0 <= cpu) {
+        pin_cpu_(cpu);
+    }
+
     for ( ; !g_do_term_; ) {
 
+        if (g_do_prof_dump_) {
+            g_do_prof_dump_ = 0;
+            prof_dump_();
+        }
+
         memcpy(&rfds, &rfds_init, sizeof(rfds));
         tv = timeout_init;
         ret = select(nfds, &rfds, NULL, NULL, &tv);
         if (ret < 0) {
-            perror("select");
+            if (EINTR != errno) {   /* a signal, e.g. SIGINT: just loop */
+                perror("select");
+            }
 
         } else if (0 == ret) {
 #if defined(ENABLE_DEBUG)
             fprintf(stderr, "select() timeout\n");
 #endif /* defined(ENABLE_DEBUG) */
 
-        } else if (FD_ISSET(socket_fd, &rfds)) {
-            /*
-             * UDP 通信ではオプション無しで recv() や recvfrom() を使うと
-             * 受信キューからその回のデータを消してしまう。従って、受信
-             * バッファのサイズが受信データよりも小さい場合、受信しきら
-             * なかったデータは消えてしまう。 MSG_PEEK オプションを指定
-             * すればこの挙動を抑制可能である (つまり次も同じデータを受信
-             * できることになる) 。
-             *
-             * 応用として可変長データの受信が可能になる。つまり
-             * クライアントで送信データの先頭付近にデータ長を含めておき、
-             * サーバーでは MSG_PEEK で一度空読みしそれを取得、適切な
-             * バッファサイズを確保した上で再度 (MSG_PEEK 無しで) 受信
-             * 処理をすればいい。
-             */
-            ssize_t nr = recv(socket_fd, buf, sizeof(buf) - 1, 0);
-            if (nr < 0) {
-                if (EAGAIN == errno) {
-                    fprintf(stderr, "recv: data isn't yet reached\n");
-                } else {
-                    perror("recv");
-                    g_do_term_ = 1;
-                }
+        } else {
+            bool signalled = false;
 
-            } else if (0 == nr) {
-                fprintf(stderr,
-                        "recv: peer shutted down or "
-                        "0 byte packet received\n");
+            for (i = 0; i < g_nlisteners_; ++i) {
+                struct listener *p_l = &g_listeners_[i];
+                int nr = -1;
+                unsigned n = 0;
 
-            } else {
-#if defined(ENABLE_DEBUG)
-                fprintf(stderr, "call delegate_()\n");
-#endif /* defined(ENABLE_DEBUG) */
-                delegate_(nr, buf);
+                if (!FD_ISSET(p_l->fd, &rfds)) {
+                    continue;
+                }
+                signalled = true;
+
+                /*
+                 * A plain recv() drops whatever part of a datagram doesn't
+                 * fit the buffer.  Rather than peeking the length first
+                 * (MSG_PEEK, then a second read), receive_batch_() reads
+                 * into pool buffers large enough for any valid packet and
+                 * detects oversized ones from the length MSG_TRUNC reports.
+                 */
+
+                /* drain the burst, but come back to check signals now and then */
+                for (n = 0; n < UDP_DRAIN_MAX && !g_do_term_; ++n) {
+                    nr = receive_batch_(p_l->fd, p_l->p_pool);
+                    if (nr < UDP_RX_BATCH) {
+                        break;
+                    }
+                }
+                report_rx_drops_(p_l);
+
+                if (nr < 0) {
+                    if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                        if (!n) {
+                            fprintf(stderr, "recv %s: data isn't yet reached\n", p_l->spec);
+                        }
+                    } else {
+                        fprintf(stderr, "recv %s: %s\n", p_l->spec, strerror(errno));
+                        g_do_term_ = 1;
+                    }
+                }
             }
-        } else {
-            fprintf(stderr,
-                    "select() didn't timeout but no sockets signalled\n");
+            if (!signalled) {
+                fprintf(stderr,
+                        "select() didn't timeout but no sockets signalled\n");
+            }
+        }
+    }
+
+    report_latency_(low_latency ? "low-latency" : "default");
+    for (i = 0; i < g_nlisteners_; ++i) {
+        const struct rx_pool *p_pool = g_listeners_[i].p_pool;
+
+        if (p_pool->drops.total || p_pool->truncated) {
+            fprintf(stderr, "recv %s: %lu datagrams dropped by kernel, %lu truncated in total\n",
+                    g_listeners_[i].spec, (unsigned long)p_pool->drops.total,
+                    (unsigned long)p_pool->truncated);
         }
+        close_listener_(&g_listeners_[i]);
     }
+    prof_dump_();
+
+#if defined(ENABLE_QUERY_SERVER)
+    g_do_term_ = 1;
+    cleanup_query_server_(query_thread, &query_fd);
+#endif /* defined(ENABLE_QUERY_SERVER) */
 
-    close(socket_fd), socket_fd = -1;
+#if defined(ENABLE_RATE_LIMIT)
+    for (i = 0; i < MAX_UDP_CLIENT_IDS; ++i) {
+        if (g_gateway_buckets_[i].throttled) {
+            fprintf(stderr, "gateway %02u: %u packets throttled\n",
+                    i, g_gateway_buckets_[i].throttled);
+        }
+    }
+#endif /* defined(ENABLE_RATE_LIMIT) */
 
+    capture_close_(&g_capture_);
+    prof_cleanup_();
+    cleanup_sinks_();
     cleanup_delegate_();
 
 #if defined(ENABLE_DEBUG)
@@ -0,0 +1,242 @@
+/**
+ * \file shm_ring.h
+ * \brief SmartHive decoded record ring on POSIX shared memory
+ * \author yusuke <gachapin.2nd@gmail.com>
+ *
+ * The server is the single producer, any number of local processes may
+ * attach as consumers.  Consumers never write to the ring, so they can't
+ * slow down the producer; a consumer that falls behind detects it from
+ * the sequence numbers and skips forward (counted in `lost').
+ *
+ * Usage (consumer):
+ *
+ *      struct shm_ring_reader r;
+ *      struct hive_record rec;
+ *
+ *      if (!shm_ring_reader_open(&r, SHM_RING_NAME)) { ... }
+ *      for (;;) {
+ *          if (shm_ring_reader_next(&r, &rec)) {
+ *              ... use rec ...
+ *          } else {
+ *              ... nothing new, sleep or spin ...
+ *          }
+ *      }
+ *      shm_ring_reader_close(&r);
+ */
+#if !defined(SHM_RING_H_INCLUDED)
+#define SHM_RING_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+#define SHM_RING_NAME     ("/smart_hive_ring")  /**< appears as /dev/shm/smart_hive_ring */
+#define SHM_RING_MAGIC    (0x47525348U)         /**< "SHRG" */
+#define SHM_RING_VERSION  (1)
+#define SHM_RING_SLOTS    (4096)                /**< must be power of 2 */
+
+
+
+/** Decoded LoRa record (raw integer fields, same scale as the packet) */
+struct hive_record {
+    uint64_t rx_time_ns;    /**< arrival time (CLOCK_REALTIME, ns) */
+    uint32_t lat_n;         /**< latitude N x 1000000 */
+    uint32_t lon_e;         /**< longitude E x 1000000 */
+    uint16_t temp[4];       /**< temperature x 10 */
+    uint16_t rh[4];         /**< RH. x 10 */
+    uint16_t vol[4];        /**< volume x 10 */
+    uint16_t weight;        /**< weight x 100 */
+    uint8_t gw_id;          /**< LoRa GW UDP client ID */
+    uint8_t dev_id;         /**< LoRa device ID */
+    uint8_t serial;         /**< packet serial number */
+    uint8_t datetime[6];    /**< yy, mm, dd, HH, MM, SS */
+    uint8_t reserved[5];
+};
+_Static_assert(sizeof(struct hive_record) == 56, "hive_record layout");
+
+struct shm_ring_slot {
+    /**
+     * ((n + 1) << 1) once record n is complete, with bit 0 set while the
+     * producer is writing it.  0 means never written.
+     */
+    _Atomic uint64_t seq;
+    struct hive_record rec;
+};
+_Static_assert(sizeof(struct shm_ring_slot) == 64, "shm_ring_slot layout");
+
+struct shm_ring {
+    uint32_t magic;             /**< SHM_RING_MAGIC once initialized */
+    uint32_t version;           /**< SHM_RING_VERSION */
+    uint32_t nslots;            /**< number of slots (power of 2) */
+    uint32_t slot_size;         /**< sizeof(struct shm_ring_slot) */
+    _Atomic uint64_t head;      /**< number of records published so far */
+    uint8_t pad[40];
+    struct shm_ring_slot slots[];
+};
+
+#define SHM_RING_MAP_SIZE(nslots_) \
+    (sizeof(struct shm_ring) + (size_t)(nslots_) * sizeof(struct shm_ring_slot))
+
+
+
+/** Producer side: publish one record (single producer only) */
+static inline void shm_ring_publish(struct shm_ring *p_, const struct hive_record *p_rec_)
+{
+    uint64_t n = atomic_load_explicit(&p_->head, memory_order_relaxed);
+    struct shm_ring_slot *p_slot = &p_->slots[n & (p_->nslots - 1)];
+
+    atomic_store_explicit(&p_slot->seq, ((n + 1) << 1) | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&p_slot->rec, p_rec_, sizeof(p_slot->rec));
+    atomic_store_explicit(&p_slot->seq, (n + 1) << 1, memory_order_release);
+    atomic_store_explicit(&p_->head, n + 1, memory_order_release);
+
+    return;
+}
+
+
+
+/** Consumer side */
+struct shm_ring_reader {
+    int fd;
+    struct shm_ring *p_ring;
+    size_t map_size;
+    uint64_t next;      /**< sequence number of the next record to read */
+    uint64_t lost;      /**< records overwritten before we could read them */
+};
+
+
+
+static inline bool shm_ring_reader_open(struct shm_ring_reader *p_, const char *p_name_)
+{
+    struct stat st;
+    struct shm_ring *p_ring = NULL;
+
+    memset(p_, 0, sizeof(*p_));
+    p_->fd = -1;
+
+    p_->fd = shm_open(p_name_, O_RDONLY, 0);
+    if (p_->fd < 0) {
+        return false;
+    }
+    if (fstat(p_->fd, &st) || (size_t)st.st_size < sizeof(struct shm_ring)) {
+        goto fail;
+    }
+    p_ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, p_->fd, 0);
+    if (MAP_FAILED == p_ring) {
+        goto fail;
+    }
+    if (p_ring->magic != SHM_RING_MAGIC ||
+            p_ring->version != SHM_RING_VERSION ||
+            p_ring->slot_size != sizeof(struct shm_ring_slot) ||
+            (size_t)st.st_size < SHM_RING_MAP_SIZE(p_ring->nslots)) {
+        munmap(p_ring, st.st_size);
+        goto fail;
+    }
+    p_->p_ring   = p_ring;
+    p_->map_size = st.st_size;
+
+    /* start from the live edge */
+    p_->next = atomic_load_explicit(&p_ring->head, memory_order_acquire);
+
+    return true;
+
+fail:
+    close(p_->fd), p_->fd = -1;
+    return false;
+}
+
+
+
+static inline void shm_ring_reader_close(struct shm_ring_reader *p_)
+{
+    if (p_->p_ring) {
+        munmap(p_->p_ring, p_->map_size);
+        p_->p_ring = NULL;
+    }
+    if (0 <= p_->fd) {
+        close(p_->fd), p_->fd = -1;
+    }
+
+    return;
+}
+
+
+
+/**
+ * Fetch the next record.
+ *
+ * \retval true  a record was copied to *p_rec_
+ * \retval false no new record yet
+ */
+static inline bool shm_ring_reader_next(struct shm_ring_reader *p_, struct hive_record *p_rec_)
+{
+    const struct shm_ring *p_ring = p_->p_ring;
+    const uint64_t nslots = p_ring->nslots;
+
+    for (;;) {
+        const struct shm_ring_slot *p_slot = NULL;
+        uint64_t head = atomic_load_explicit(
+                (_Atomic uint64_t *)&p_ring->head, memory_order_acquire);
+        uint64_t want = 0;
+        uint64_t s1 = 0;
+        uint64_t s2 = 0;
+
+        if (head < p_->next) {
+            /* producer restarted and re-initialized the ring */
+            p_->next = 0;
+        }
+        if (head == p_->next) {
+            return false;
+        }
+        if (nslots < head - p_->next) {
+            p_->lost += head - nslots - p_->next;
+            p_->next  = head - nslots;
+        }
+
+        p_slot = &p_ring->slots[p_->next & (nslots - 1)];
+        want = (p_->next + 1) << 1;
+
+        s1 = atomic_load_explicit(
+                (_Atomic uint64_t *)&p_slot->seq, memory_order_acquire);
+        if (s1 != want) {
+            if (want < (s1 & ~(uint64_t)1)) {
+                /* lapped while we were looking, retry from the new head */
+                p_->lost += 1;
+                p_->next += 1;
+                continue;
+            }
+            /* still being written */
+            return false;
+        }
+
+        memcpy(p_rec_, (const void *)&p_slot->rec, sizeof(*p_rec_));
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(
+                (_Atomic uint64_t *)&p_slot->seq, memory_order_relaxed);
+        if (s2 != s1) {
+            /* overwritten under us */
+            p_->lost += 1;
+            p_->next += 1;
+            continue;
+        }
+
+        p_->next += 1;
+        return true;
+    }
+}
+
+
+
+#endif /* !defined(SHM_RING_H_INCLUDED) */
+
+
+
+/* vim: set ts=4 sts=4 sw=4 expandtab autoindent : */
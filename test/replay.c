@@ -0,0 +1,367 @@
+/**
+ * \file replay.c
+ * \brief Re-send a capture file (smart_hive_udp_server -w) to the server
+ *
+ *  usage: replay [-s SPEED] [-a ADDR] [-p PORT] [-m N=DEST ...] FILE
+ *
+ *      -s SPEED : 1 = original timing (default), N = N times faster,
+ *                 0 = as fast as possible
+ *      -a ADDR  : destination address, IPv4 or IPv6 (default 127.0.0.1)
+ *      -p PORT  : destination port (default 50812)
+ *      -m N=DEST: datagrams received by listener N (-l of the capturing
+ *                 server, from 0) go to DEST, ADDR:PORT or [ADDR6]:PORT,
+ *                 instead; repeatable
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../hive_capture.h"
+
+
+
+#define UDP_SERVER_PORT (50812)
+#define UDP_SERVER_ADDR ("127.0.0.1")
+
+#define REPLAY_BATCH        (64)        /**< datagrams per sendmmsg() */
+#define REPLAY_SLACK_NSEC   (50000)     /**< send early if due within this */
+#define REPLAY_MAX_DESTS    (9)         /**< -a/-p and -m given at most */
+#define REPLAY_MAX_LISTENERS (256)      /**< struct hive_capture_record.listener */
+
+/** Where datagrams go */
+struct dest {
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    int sock;               /**< connected to ss */
+};
+
+
+
+static volatile sig_atomic_t g_do_term_ = 0;
+
+
+
+static void sig_handler(int sig)
+{
+    (void)sig;
+    g_do_term_ = 1;
+    return;
+}
+
+
+
+static uint64_t monotonic_ns_(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+
+
+static void sleep_until_(uint64_t deadline_ns_)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = deadline_ns_ / 1000000000U;
+    ts.tv_nsec = deadline_ns_ % 1000000000U;
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) &&
+            !g_do_term_) {
+        ;
+    }
+
+    return;
+}
+
+
+
+/** Set *p_ to ADDR (IPv4 or IPv6) and PORT */
+static bool dest_set_(struct dest *p_, const char *p_addr_, unsigned long port_)
+{
+    struct sockaddr_in *p_sa = (struct sockaddr_in *)&p_->ss;
+    struct sockaddr_in6 *p_sa6 = (struct sockaddr_in6 *)&p_->ss;
+
+    if (!port_ || 65535 < port_) {
+        return false;
+    }
+    memset(&p_->ss, 0, sizeof(p_->ss));
+    if (1 == inet_pton(AF_INET, p_addr_, &p_sa->sin_addr.s_addr)) {
+        p_sa->sin_family = AF_INET;
+        p_sa->sin_port   = htons(port_);
+        p_->sslen        = sizeof(*p_sa);
+    } else if (1 == inet_pton(AF_INET6, p_addr_, &p_sa6->sin6_addr)) {
+        p_sa6->sin6_family = AF_INET6;
+        p_sa6->sin6_port   = htons(port_);
+        p_->sslen          = sizeof(*p_sa6);
+    } else {
+        return false;
+    }
+    p_->sock = -1;
+
+    return true;
+}
+
+
+
+/** Set *p_ from "ADDR:PORT" or "[ADDR6]:PORT" */
+static bool dest_parse_(struct dest *p_, const char *p_spec_)
+{
+    char host[INET6_ADDRSTRLEN];
+    const char *p_host = p_spec_;
+    const char *p_port = NULL;
+    char *p_end = NULL;
+    size_t hostlen = 0;
+    unsigned long port = 0;
+
+    if ('[' == p_spec_[0]) {
+        const char *p_close = strchr(p_spec_, ']');
+
+        if (!p_close || ':' != p_close[1]) {
+            return false;
+        }
+        p_host  = p_spec_ + 1;
+        hostlen = p_close - p_host;
+        p_port  = p_close + 2;
+    } else {
+        p_port = strrchr(p_spec_, ':');
+        if (!p_port) {
+            return false;
+        }
+        hostlen = p_port - p_host;
+        ++p_port;
+    }
+    if (sizeof(host) <= hostlen) {
+        return false;
+    }
+    memcpy(host, p_host, hostlen);
+    host[hostlen] = '\0';
+    port = strtoul(p_port, &p_end, 10);
+    if (!*p_port || *p_end) {
+        return false;
+    }
+
+    return dest_set_(p_, host, port);
+}
+
+
+
+static void usage_(const char *p_prog_)
+{
+    fprintf(stderr, "usage: %s [-s SPEED] [-a ADDR] [-p PORT] [-m N=ADDR:PORT ...] FILE\n",
+            p_prog_);
+    return;
+}
+
+
+
+/** Send msgs_[0..n_) through p_dest_; returns how many went out */
+static unsigned send_batch_(const struct dest *p_dest_, struct mmsghdr *p_msgs_, unsigned n_)
+{
+    unsigned i = 0;
+
+    while (i < n_) {
+        int nr = sendmmsg(p_dest_->sock, &p_msgs_[i], n_ - i, 0);
+
+        if (nr < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror("sendmmsg");
+            g_do_term_ = 1;
+            break;
+        }
+        i += nr;
+    }
+
+    return i;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    static struct mmsghdr msgs[REPLAY_BATCH];
+    static struct iovec iovs[REPLAY_BATCH];
+
+    static struct dest dests[REPLAY_MAX_DESTS];
+    static uint8_t dest_of[REPLAY_MAX_LISTENERS];  /**< listener -> dests[] */
+    unsigned ndests = 1;                            /**< dests[0]: -a/-p */
+
+    const char *p_addr = UDP_SERVER_ADDR;
+    unsigned long port = UDP_SERVER_PORT;
+    double speed = 1.0;
+
+    struct stat st;
+    uint8_t *p_map = NULL;
+    size_t off = 0;
+    int fd = -1;
+    int ret = 0;
+    unsigned i = 0;
+
+    uint64_t cap_begin = 0;
+    uint64_t wall_begin = 0;
+    uint64_t nsent = 0;
+    uint64_t nbytes = 0;
+    double elapsed = 0.0;
+
+    while (-1 != (ret = getopt(argc, argv, "s:a:p:m:h"))) {
+        switch (ret) {
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'a':
+            p_addr = optarg;
+            break;
+        case 'p':
+            port = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            {
+                char *p_end = NULL;
+                unsigned long listener = strtoul(optarg, &p_end, 10);
+
+                if (p_end == optarg || '=' != *p_end ||
+                        REPLAY_MAX_LISTENERS <= listener ||
+                        REPLAY_MAX_DESTS <= ndests ||
+                        !dest_parse_(&dests[ndests], p_end + 1)) {
+                    fprintf(stderr, "-m: N=ADDR:PORT or N=[ADDR6]:PORT (%d at most)\n",
+                            REPLAY_MAX_DESTS - 1);
+                    return EXIT_FAILURE;
+                }
+                dest_of[listener] = ndests++;
+            }
+            break;
+        default:
+            usage_(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc <= optind || speed < 0) {
+        usage_(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    p_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == p_map) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    off = hive_capture_check(p_map, st.st_size);
+    if (!off) {
+        fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (!dest_set_(&dests[0], p_addr, port)) {
+        fprintf(stderr, "bad destination: %s port %lu\n", p_addr, port);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < ndests; ++i) {
+        dests[i].sock = socket(dests[i].ss.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (dests[i].sock < 0) {
+            perror("client socket");
+            return EXIT_FAILURE;
+        }
+        if (connect(dests[i].sock, (struct sockaddr *)&dests[i].ss, dests[i].sslen)) {
+            perror("connect");
+            return EXIT_FAILURE;
+        }
+    }
+
+    signal(SIGINT, sig_handler);
+
+    wall_begin = monotonic_ns_();
+    for (ret = 1; 0 < ret && !g_do_term_; ) {
+        struct hive_capture_record rec;
+        const uint8_t *p_data = NULL;
+        unsigned dest = 0;
+        unsigned n = 0;
+
+        /* collect datagrams due now (or within the slack) for one destination */
+        for (n = 0; n < REPLAY_BATCH; ) {
+            size_t next = off;
+
+            ret = hive_capture_next(p_map, st.st_size, &next, &rec, &p_data);
+            if (ret <= 0) {
+                break;
+            }
+            if (n && dest_of[rec.listener] != dest) {
+                break;  /* flush what we have first */
+            }
+            dest = dest_of[rec.listener];
+            if (!cap_begin) {
+                cap_begin = rec.ts_ns;
+            }
+            if (0 < speed) {
+                /*
+                 * Listeners are drained one after another, so a record may
+                 * be older than the first one; it is due right away.
+                 */
+                uint64_t ofs = (cap_begin < rec.ts_ns) ? rec.ts_ns - cap_begin : 0;
+                uint64_t due = wall_begin + (uint64_t)((double)ofs / speed);
+
+                if (monotonic_ns_() + REPLAY_SLACK_NSEC < due) {
+                    if (n) {
+                        break;  /* flush what we have first */
+                    }
+                    sleep_until_(due);
+                    if (g_do_term_) {
+                        break;
+                    }
+                }
+            }
+            iovs[n].iov_base = (void *)p_data;
+            iovs[n].iov_len  = rec.len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov    = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            nbytes += rec.len;
+            off = next;
+            ++n;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "truncated capture at offset %lu\n", (unsigned long)off);
+        }
+
+        nsent += send_batch_(&dests[dest], msgs, n);
+    }
+
+    elapsed = (double)(monotonic_ns_() - wall_begin) / 1000000000;
+    printf("sent %lu datagrams (%lu bytes) in %.3lf sec, %.0lf pkt/s\n",
+            (unsigned long)nsent, (unsigned long)nbytes, elapsed,
+            elapsed ? nsent / elapsed : 0.0);
+
+    for (i = 0; i < ndests; ++i) {
+        close(dests[i].sock);
+    }
+    munmap(p_map, st.st_size);
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
+
+
+
+/* vim: set ts=4 sts=4 sw=4 expandtab autoindent : */
@@ -0,0 +1,88 @@
+/**
+ * \file shm_ring_consumer.c
+ * \brief Example consumer of the SmartHive shared memory record ring
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../shm_ring.h"
+
+
+
+#define IDLE_SLEEP_NSEC (1000000)   /* 1ms */
+
+
+
+static volatile sig_atomic_t g_do_term_ = 0;
+
+
+
+static void sig_handler(int sig)
+{
+    g_do_term_ = 1;
+    return;
+}
+
+
+
+int main(void)
+{
+    struct shm_ring_reader reader;
+    struct hive_record rec;
+    uint64_t last_lost = 0;
+    struct timespec idle = { 0, IDLE_SLEEP_NSEC };
+
+    signal(SIGINT, sig_handler);
+
+    if (!shm_ring_reader_open(&reader, SHM_RING_NAME)) {
+        perror("shm_ring_reader_open");
+        fprintf(stderr, "is smart_hive_udp_server running?\n");
+        return EXIT_FAILURE;
+    }
+
+    for ( ; !g_do_term_; ) {
+        if (!shm_ring_reader_next(&reader, &rec)) {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        if (last_lost != reader.lost) {
+            fprintf(stderr, "overrun: %lu records lost\n",
+                    (unsigned long)(reader.lost - last_lost));
+            last_lost = reader.lost;
+        }
+
+        printf("%02u-%02u,n=%u"
+                ",%02u%02u%02u%02u%02u%02u"
+                ",%lf,%lf"
+                ",%u,%u,%u,%u"
+                ",%u,%u,%u,%u"
+                ",%u,%u,%u,%u"
+                ",%u\n"
+                , rec.gw_id, rec.dev_id, rec.serial
+                , rec.datetime[0], rec.datetime[1], rec.datetime[2]
+                , rec.datetime[3], rec.datetime[4], rec.datetime[5]
+                , (double)rec.lon_e / 1000000, (double)rec.lat_n / 1000000
+                , rec.temp[0], rec.temp[1], rec.temp[2], rec.temp[3]
+                , rec.rh[0], rec.rh[1], rec.rh[2], rec.rh[3]
+                , rec.vol[0], rec.vol[1], rec.vol[2], rec.vol[3]
+                , rec.weight);
+        fflush(stdout);
+    }
+
+    shm_ring_reader_close(&reader);
+
+    return EXIT_SUCCESS;
+}
+
+
+
+/* vim: set ts=4 sts=4 sw=4 expandtab autoindent : */
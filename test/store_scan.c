@@ -0,0 +1,189 @@
+/**
+ * \file store_scan.c
+ * \brief Time-range scan of the SmartHive columnar segment store
+ *
+ * usage: store_scan [-d DIR] [-g GW] [-n DEV] [-s FROM] [-e TO] [COLUMN ...]
+ *
+ * Prints time, gw, dev and the given columns (default: all) as CSV for the
+ * rows with FROM <= time < TO (unix seconds).  Segments are skipped by
+ * their min/max and ID bitmaps, and only the filter columns and the
+ * requested ones are read.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include "../hive_store.h"
+
+
+
+static int is_segment_(const struct dirent *p_ent_)
+{
+    const size_t len = strlen(p_ent_->d_name);
+    const size_t slen = strlen(HIVE_STORE_SUFFIX);
+
+    return slen < len && !strcmp(&p_ent_->d_name[len - slen], HIVE_STORE_SUFFIX);
+}
+
+
+
+static void usage_(const char *p_prog_)
+{
+    fprintf(stderr,
+            "usage: %s [-d DIR] [-g GW] [-n DEV] [-s FROM] [-e TO] [COLUMN ...]\n"
+            "  -d DIR    store directory (default: %s)\n"
+            "  -g GW     gateway (UDP client) ID\n"
+            "  -n DEV    LoRa device ID\n"
+            "  -s FROM   first time, unix seconds (inclusive)\n"
+            "  -e TO     last time, unix seconds (exclusive)\n"
+            , p_prog_, HIVE_STORE_DIR);
+
+    return;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    const char *p_dir = HIVE_STORE_DIR;
+    int gw = -1;
+    int dev = -1;
+    int64_t t_from = INT64_MIN;
+    int64_t t_to = INT64_MAX;
+    unsigned cols[HIVE_STORE_NCOLS];
+    unsigned ncols = 0;
+    struct dirent **pp_ents = NULL;
+    int nents = 0;
+    unsigned long nscanned = 0;
+    unsigned long nskipped = 0;
+    unsigned long nmatched = 0;
+    int ret = -1;
+    int i = 0;
+    unsigned c = 0;
+
+    while (-1 != (ret = getopt(argc, argv, "d:g:n:s:e:h"))) {
+        switch (ret) {
+        case 'd':
+            p_dir = optarg;
+            break;
+        case 'g':
+            gw = strtol(optarg, NULL, 0) & 0xff;
+            break;
+        case 'n':
+            dev = strtol(optarg, NULL, 0) & 0xff;
+            break;
+        case 's':
+            t_from = strtoll(optarg, NULL, 0) * 1000;
+            break;
+        case 'e':
+            t_to = strtoll(optarg, NULL, 0) * 1000;
+            break;
+        case 'h':
+            usage_(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage_(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = optind; i < argc; ++i) {
+        for (c = HIVE_STORE_COL_TEMP0; c < HIVE_STORE_NCOLS; ++c) {
+            if (!strcmp(argv[i], hive_store_col_name(c))) {
+                break;
+            }
+        }
+        if (HIVE_STORE_NCOLS <= c || HIVE_STORE_NCOLS <= ncols) {
+            fprintf(stderr, "unknown column: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        cols[ncols++] = c;
+    }
+    if (!ncols) {
+        for (c = HIVE_STORE_COL_TEMP0; c < HIVE_STORE_NCOLS; ++c) {
+            cols[ncols++] = c;
+        }
+    }
+
+    nents = scandir(p_dir, &pp_ents, is_segment_, alphasort);
+    if (nents < 0) {
+        perror(p_dir);
+        return EXIT_FAILURE;
+    }
+
+    printf("time,gw,dev");
+    for (c = 0; c < ncols; ++c) {
+        printf(",%s", hive_store_col_name(cols[c]));
+    }
+    printf("\n");
+
+    for (i = 0; i < nents; ++i) {
+        struct hive_store_segment seg;
+        const struct hive_store_header *p_hdr = NULL;
+        char path[PATH_MAX];
+        uint64_t row = 0;
+
+        snprintf(path, sizeof(path), "%s/%s", p_dir, pp_ents[i]->d_name);
+        free(pp_ents[i]);
+        if (!hive_store_segment_open(&seg, path)) {
+            fprintf(stderr, "%s: not a segment, skipped\n", path);
+            continue;
+        }
+        p_hdr = seg.p_hdr;
+
+        /* whole segment out of range */
+        if (!seg.nrows ||
+                t_to <= p_hdr->col_min[HIVE_STORE_COL_TIME] ||
+                p_hdr->col_max[HIVE_STORE_COL_TIME] < t_from ||
+                (0 <= gw && !hive_store_mask_test(p_hdr->gw_mask, gw)) ||
+                (0 <= dev && !hive_store_mask_test(p_hdr->dev_mask, dev))) {
+            ++nskipped;
+            hive_store_segment_close(&seg);
+            continue;
+        }
+        ++nscanned;
+
+        for (row = 0; row < seg.nrows; ++row) {
+            int64_t t = 0;
+
+            if (0 <= dev && hive_store_get(&seg, HIVE_STORE_COL_DEV, row) != dev) {
+                continue;
+            }
+            if (0 <= gw && hive_store_get(&seg, HIVE_STORE_COL_GW, row) != gw) {
+                continue;
+            }
+            t = hive_store_get(&seg, HIVE_STORE_COL_TIME, row);
+            if (t < t_from || t_to <= t) {
+                continue;
+            }
+
+            printf("%lld.%03lld,%02u,%02u"
+                    , (long long)(t / 1000), (long long)(t % 1000)
+                    , (unsigned)hive_store_get(&seg, HIVE_STORE_COL_GW, row)
+                    , (unsigned)hive_store_get(&seg, HIVE_STORE_COL_DEV, row));
+            for (c = 0; c < ncols; ++c) {
+                printf(",%lld", (long long)hive_store_get(&seg, cols[c], row));
+            }
+            printf("\n");
+            ++nmatched;
+        }
+
+        hive_store_segment_close(&seg);
+    }
+    free(pp_ents);
+
+    fprintf(stderr, "%lu segments scanned, %lu skipped, %lu rows\n",
+            nscanned, nskipped, nmatched);
+
+    return EXIT_SUCCESS;
+}
+
+
+
+/* vim: set ts=4 sts=4 sw=4 expandtab autoindent : */
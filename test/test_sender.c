@@ -21,11 +21,21 @@
 #define LORA_PACKET_SIZE  (LORA_HEADER_SIZE + LORA_PAYLOAD_SIZE)
 #define MAX_LORA_CLIENTS  (100)
 
-#define UDP_PROTOCOL_VERSION  (0x12)
+#define UDP_PROTOCOL_VERSION      (0x12)
+#define UDP_PROTOCOL_VERSION_CRC  (0x13)    /**< with CRC32C trailer */
 #define UDP_PKTID_PUSH_DATA   (0)
+#define UDP_PKTID_BATCH_DATA  (1)
+#define UDP_PKTID_HEARTBEAT   (2)
 #define UDP_HEADER_SIZE       (4)
+#define UDP_EXT_HEADER_SIZE   (6)
+#define UDP_CRC_SIZE          (4)
 #define UDP_PACKET_SIZE       (UDP_HEADER_SIZE + LORA_PACKET_SIZE)
+#define UDP_PACKET_SIZE_CRC   (UDP_PACKET_SIZE + UDP_CRC_SIZE)
+#define UDP_BATCH_MAX_READINGS  (255)
+#define UDP_MAX_PACKET_SIZE   (UDP_EXT_HEADER_SIZE + 1 + \
+        UDP_BATCH_MAX_READINGS * LORA_PACKET_SIZE + UDP_CRC_SIZE)
 #define MAX_UDP_CLIENTS       (2)
+#define UDP_CLIENT_ID_MAIN    (1)
 
 #define UDP_SERVER_PORT (50812)
 #define UDP_SERVER_ADDR ("127.0.0.1")
@@ -90,13 +100,89 @@ static uint32_t be32_to_uint32_(const uint8_t *p_)
     return ret;
 }
 
-int main(void)
+/** CRC32C (Castagnoli), bitwise; the server has the fast one */
+static uint32_t crc32c_(const uint8_t *p_, size_t len_)
+{
+    uint32_t crc = ~0U;
+    int i = 0;
+
+    while (len_--) {
+        crc ^= *p_++;
+        for (i = 0; i < 8; ++i) {
+            crc = (crc >> 1) ^ (0x82f63b78U & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+int main(int argc, char *argv[])
 {
     int fd = -1;
     struct sockaddr_in sa = { 0 };
-    uint8_t buf[UDP_PACKET_SIZE] = { 0 };
+    static uint8_t buf[UDP_MAX_PACKET_SIZE];
+    bool with_crc = false;
+    bool heartbeat = false;
+    int udp_id = UDP_CLIENT_ID_MAIN;
+    int nreadings = 0;
+    int repeat = 1;
+    unsigned delay = 0;
+    size_t hdrsize = UDP_HEADER_SIZE;
+    size_t datasize = LORA_PACKET_SIZE;
+    size_t len = 0;
+    uint8_t *p_data = NULL;
     uint8_t *p_lora = NULL;
     ssize_t nr = 0;
+    int opt = 0;
+    int i = 0;
+
+    /*
+     * -c   : append CRC32C trailer (UDP_PROTOCOL_VERSION_CRC)
+     * -b N : batch data of N readings (devices 1..N) in one packet
+     * -H   : heartbeat
+     * -g N : UDP client ID (default: UDP_CLIENT_ID_MAIN)
+     * -r N : send the same packet N times (retransmission)
+     * -d S : wait S seconds between them (e.g. past DEDUP_MAX_AGE_SEC)
+     */
+    while (-1 != (opt = getopt(argc, argv, "cb:Hg:r:d:"))) {
+        switch (opt) {
+        case 'c':
+            with_crc = true;
+            break;
+        case 'b':
+            nreadings = atoi(optarg);
+            if (nreadings < 1 || UDP_BATCH_MAX_READINGS < nreadings) {
+                fprintf(stderr, "-b: 1..%d\n", UDP_BATCH_MAX_READINGS);
+                return EXIT_FAILURE;
+            }
+            datasize = 1 + nreadings * LORA_PACKET_SIZE;
+            break;
+        case 'H':
+            heartbeat = true;
+            datasize  = 0;
+            break;
+        case 'g':
+            udp_id = atoi(optarg);
+            if (udp_id < 0 || 255 < udp_id) {
+                fprintf(stderr, "-g: 0..255\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            if (repeat < 1) {
+                fprintf(stderr, "-r: 1..\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            delay = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c] [-g N] [-r N] [-d SEC] [-b N | -H]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
     fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (fd < 0) {
@@ -121,13 +207,31 @@ int main(void)
      *      * B (1 byte) : Length (from A to E)
      *      * C (1 byte) : UDP client ID
      *      * D (1 byte) : Packet type
-     *      * E (B-4 bytes) : LoRa data (max 127 bytes)
+     *      * E (B-4 bytes) : push data: LoRa data
+     *                        batch data: count + LoRa data x count
+     *                        heartbeat: none
+     *
+     *  With A == UDP_PROTOCOL_VERSION_CRC, E is followed by CRC32C of A..E
+     *  (4 bytes, big endian), and B counts it too.  Packets longer than 255
+     *  bytes have B == 0 and a 2 byte length (big endian) after D.
      */
-    buf[0] = UDP_PROTOCOL_VERSION;
-    buf[1] = UDP_PACKET_SIZE;
-    buf[2] = 0;
-    buf[3] = UDP_PKTID_PUSH_DATA;
-    p_lora = &buf[4];
+    len = hdrsize + datasize + (with_crc ? UDP_CRC_SIZE : 0);
+    if (255 < len) {
+        hdrsize = UDP_EXT_HEADER_SIZE;
+        len    += UDP_EXT_HEADER_SIZE - UDP_HEADER_SIZE;
+    }
+    buf[0] = with_crc ? UDP_PROTOCOL_VERSION_CRC : UDP_PROTOCOL_VERSION;
+    buf[1] = (UDP_HEADER_SIZE == hdrsize) ? len : 0;
+    buf[2] = udp_id;
+    buf[3] = heartbeat ? UDP_PKTID_HEARTBEAT :
+        nreadings ? UDP_PKTID_BATCH_DATA : UDP_PKTID_PUSH_DATA;
+    if (UDP_EXT_HEADER_SIZE == hdrsize) {
+        uint16_to_be16_(len, &buf[4]);
+    }
+    p_data = &buf[hdrsize];
+    if (nreadings) {
+        *p_data++ = nreadings;
+    }
 
     /*
      * LoRa data format:
@@ -153,34 +257,46 @@ int main(void)
      *          * VOLx4 (8 bytes) volume (each 2 bytes) x 4
      *          * WT (2 bytes) weight
      */
-    p_lora[0] = 1;
-    p_lora[1] = 2;
-    p_lora[2] = 1;
-    p_lora[3] = 18;     /* yy */
-    p_lora[4] = 8;      /* mm */
-    p_lora[5] = 12;     /* dd */
-    p_lora[6] = 15;     /* HH */
-    p_lora[7] = 25;     /* MM */
-    p_lora[8] = 30;     /* SS */
-
-    uint32_to_be32_( 35681167, &p_lora[9]);
-    uint32_to_be32_(139767052, &p_lora[13]);
-    uint16_to_be16_(101,       &p_lora[17]);
-    uint16_to_be16_(201,       &p_lora[19]);
-    uint16_to_be16_(301,       &p_lora[21]);
-    uint16_to_be16_(401,       &p_lora[23]);
-    uint16_to_be16_(112,       &p_lora[25]);
-    uint16_to_be16_(222,       &p_lora[27]);
-    uint16_to_be16_(332,       &p_lora[29]);
-    uint16_to_be16_(442,       &p_lora[31]);
-    uint16_to_be16_(123,       &p_lora[33]);
-    uint16_to_be16_(223,       &p_lora[35]);
-    uint16_to_be16_(323,       &p_lora[37]);
-    uint16_to_be16_(423,       &p_lora[39]);
-    uint16_to_be16_(501,       &p_lora[41]);
-
-    nr = sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&sa, sizeof(sa));
-    printf("sendto() returned %ld\n", nr);
+    for (i = 0; i < (heartbeat ? 0 : nreadings ? nreadings : 1); ++i) {
+        p_lora = &p_data[i * LORA_PACKET_SIZE];
+        p_lora[0] = 1 + i;
+        p_lora[1] = 2;
+        p_lora[2] = 1;
+        p_lora[3] = 18;     /* yy */
+        p_lora[4] = 8;      /* mm */
+        p_lora[5] = 12;     /* dd */
+        p_lora[6] = 15;     /* HH */
+        p_lora[7] = 25;     /* MM */
+        p_lora[8] = 30;     /* SS */
+
+        uint32_to_be32_( 35681167, &p_lora[9]);
+        uint32_to_be32_(139767052, &p_lora[13]);
+        uint16_to_be16_(101,       &p_lora[17]);
+        uint16_to_be16_(201,       &p_lora[19]);
+        uint16_to_be16_(301,       &p_lora[21]);
+        uint16_to_be16_(401,       &p_lora[23]);
+        uint16_to_be16_(112,       &p_lora[25]);
+        uint16_to_be16_(222,       &p_lora[27]);
+        uint16_to_be16_(332,       &p_lora[29]);
+        uint16_to_be16_(442,       &p_lora[31]);
+        uint16_to_be16_(123,       &p_lora[33]);
+        uint16_to_be16_(223,       &p_lora[35]);
+        uint16_to_be16_(323,       &p_lora[37]);
+        uint16_to_be16_(423,       &p_lora[39]);
+        uint16_to_be16_(501,       &p_lora[41]);
+    }
+
+    if (with_crc) {
+        uint32_to_be32_(crc32c_(buf, len - UDP_CRC_SIZE), &buf[len - UDP_CRC_SIZE]);
+    }
+
+    for (i = 0; i < repeat; ++i) {
+        if (i && delay) {
+            sleep(delay);
+        }
+        nr = sendto(fd, buf, len, 0, (struct sockaddr *)&sa, sizeof(sa));
+        printf("sendto() returned %ld\n", nr);
+    }
 
     close(fd);
     fd = -1;